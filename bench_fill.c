@@ -0,0 +1,174 @@
+// paint4.c の fill の速さを測るベンチマーク
+// 使い方: gcc -O2 -o bench_fill bench_fill.c && ./bench_fill [幅 高さ (既定 2000 2000)] [回数 (既定 10)]
+//
+// 何も描かれていないキャンバス全体を pen で塗り、それを空白で塗り直すのを繰り返す
+// color は color_getter が最も多く strcmp する "cyan" にしておく
+//
+// 1. paint4.c をそのまま取り込み、実際の search_for_fill を測る
+// 2. 色を1マスごとに color_getter で求めていたころとの比較は、元のコードがもう残っていないので、
+//    同じ走査線塗りつぶしを単純な行優先の配列に書いたもの (合成したモデル) で、
+//    1マスごとに color_getter 相当を呼ぶ場合と解決済みの色を使う場合を比べる
+//    タイルなどを通さないので、1. とは数字を直接比べられない
+
+#define main paint4_main
+#include "paint4.c"
+#undef main
+
+double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// paint4.c の search_for_fill を使う
+double run_paint4(const int width, const int height, const int times){
+    quiet = 1;
+    Canvas* c = init_canvas(width, height, '*');
+    set_color(c, "cyan");
+    const double t0 = now();
+    for(int k=0 ; k<times ; k++){
+        c->pen = '*';
+        search_for_fill(c, 0, 0);
+        c->pen = ' ';
+        search_for_fill(c, 0, 0);
+    }
+    const double t = now()-t0;
+    free_canvas(c);
+    return t;
+}
+
+// ここから合成したモデル
+typedef struct{
+    int width;
+    int height;
+    Cell* cells;
+    char pen;
+    char* color;
+    int colorcode;
+} FlatCanvas;
+
+int flat_color_getter(FlatCanvas* c){
+    char* co = c->color;
+    if(strcmp(co,"red")==0){
+        return 31;
+    }else if(strcmp(co, "green")==0){
+        return 32;
+    }else if(strcmp(co, "yellow")==0){
+        return 33;
+    }else if(strcmp(co, "blue")==0){
+        return 34;
+    }else if(strcmp(co, "magenta")==0){
+        return 35;
+    }else if(strcmp(co, "cyan")==0){
+        return 36;
+    }
+    return 0;
+}
+
+// 走査線塗りつぶし。cached が0なら1マスごとに flat_color_getter を呼び、1なら c->colorcode を使う
+void flat_fill(FlatCanvas* c, int x0, int y0, const int cached){
+    const int width = c->width;
+    const int height = c->height;
+    const char pen = c->pen;
+    if(c->cells[y0*width+x0].ch == pen){
+        return;
+    }
+    size_t cap = 64;
+    size_t n = 0;
+    int (*stack)[2] = malloc(cap*sizeof(*stack));
+    stack[n][0] = x0;
+    stack[n][1] = y0;
+    n++;
+    while(n > 0){
+        n--;
+        const int x = stack[n][0];
+        const int y = stack[n][1];
+        Cell* row = c->cells+y*width;
+        if(row[x].ch == pen){
+            continue;
+        }
+        int xl = x;
+        int xr = x;
+        while(xl > 0 && row[xl-1].ch != pen){
+            xl--;
+        }
+        while(xr < width-1 && row[xr+1].ch != pen){
+            xr++;
+        }
+        for(int i=xl ; i<=xr ; i++){
+            const int color = cached ? c->colorcode : flat_color_getter(c);
+            row[i] = (Cell){.ch = pen, .color = (unsigned char)color};
+        }
+        for(int dy=-1 ; dy<=1 ; dy+=2){
+            const int ny = y+dy;
+            if(ny<0 || ny>=height){
+                continue;
+            }
+            const Cell* next = c->cells+ny*width;
+            int i = xl;
+            while(i <= xr){
+                if(next[i].ch == pen){
+                    i++;
+                    continue;
+                }
+                if(n == cap){
+                    cap *= 2;
+                    stack = realloc(stack, cap*sizeof(*stack));
+                }
+                stack[n][0] = i;
+                stack[n][1] = ny;
+                n++;
+                while(i <= xr && next[i].ch != pen){
+                    i++;
+                }
+            }
+        }
+    }
+    free(stack);
+}
+
+double run_flat(FlatCanvas* c, const int times, const int cached){
+    const double t0 = now();
+    for(int k=0 ; k<times ; k++){
+        c->pen = '*';
+        flat_fill(c, 0, 0, cached);
+        c->pen = ' ';
+        flat_fill(c, 0, 0, cached);
+    }
+    return now()-t0;
+}
+
+int main(int argc, char** argv){
+    int width = 2000;
+    int height = 2000;
+    int times = 10;
+    if(argc >= 3){
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+    }
+    if(argc >= 4){
+        times = atoi(argv[3]);
+    }
+    if(width <= 0 || height <= 0 || times <= 0 || width > CANVAS_MAX_SIZE || height > CANVAS_MAX_SIZE){
+        fprintf(stderr, "usage: %s [width height] [times]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const double cells = 2.0*times*width*height;
+    const double t_paint4 = run_paint4(width, height, times);
+    printf("paint4 search_for_fill        : %.3f s (%.1f Mcells/s)\n", t_paint4, cells/t_paint4/1e6);
+
+    char color[50] = "cyan";
+    FlatCanvas c = {.width = width, .height = height, .pen = '*', .color = color};
+    c.colorcode = flat_color_getter(&c);
+    c.cells = (Cell*)malloc((size_t)width*height*sizeof(Cell));
+    for(size_t i=0 ; i<(size_t)width*height ; i++){
+        c.cells[i] = (Cell){.ch = ' ', .color = 0};
+    }
+    const double t_getter = run_flat(&c, times, 0);
+    const double t_cached = run_flat(&c, times, 1);
+    printf("model: color_getter per cell : %.3f s (%.1f Mcells/s)\n", t_getter, cells/t_getter/1e6);
+    printf("model: cached colorcode      : %.3f s (%.1f Mcells/s)\n", t_cached, cells/t_cached/1e6);
+    free(c.cells);
+    return 0;
+}
@@ -0,0 +1,129 @@
+// paint4.c の History への push_back / pop_back の速さを測るベンチマーク
+// 使い方: gcc -O2 -o bench_history bench_history.c && ./bench_history [コマンド数 (既定 1000000)]
+//
+// 1. paint4.c をそのまま取り込み、実際の History (Arena に置く Op 形式の Command) で
+//    push_back と pop_back を測る (末尾ポインタと要素数を持つので1回あたり O(1))
+// 2. 比較用に、末尾まで辿っていたころの実装 (コマンドの文字列を持つ連結リスト) を
+//    そのまま写したもの (baseline) を測る。1回あたり O(n) で全体が O(n^2) になるので、
+//    baseline_limit 個を超える分は計測せず n^2 で外挿し、実際に測った数も並べて出す
+
+#define main paint4_main
+#include "paint4.c"
+#undef main
+
+static const size_t baseline_limit = 50000;
+
+double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// paint4.c の push_back / pop_back を使う
+void run_paint4(const size_t n, double* push, double* pop){
+    History his = (History){.begin = NULL, .end = NULL, .count = 0, .redo = NULL, .arena = {NULL}, .scratch = {0}};
+    const Op op = {.code = OP_LINE, .arg = {23, 5, 19, 17}};
+    const double t0 = now();
+    for(size_t i=0 ; i<n ; i++){
+        push_back(&his, &op);
+    }
+    const double t1 = now();
+    for(size_t i=0 ; i<n ; i++){
+        pop_back(&his);
+    }
+    const double t2 = now();
+    free_history(&his);
+    *push = t1-t0;
+    *pop = t2-t1;
+}
+
+// ここから末尾まで辿っていたころの実装
+typedef struct old_command{
+    char* str;
+    struct old_command* next;
+    struct old_command* prev;
+} OldCommand;
+
+typedef struct {
+    OldCommand* begin;
+} OldHistory;
+
+static const char* line = "line 23 5 19 17\n";
+
+OldCommand* push_back_linear(OldHistory* his, const char* str){
+    OldCommand* p = his->begin;
+    OldCommand* q = (OldCommand*)malloc(sizeof(OldCommand));
+    *q = (OldCommand){.str = (char*)malloc(strlen(str)+1), .next = NULL, .prev = NULL};
+    strcpy(q->str, str);
+    if(p==NULL){
+        his->begin = q;
+        return q;
+    }
+    while(p->next != NULL){
+        p = p->next;
+    }
+    q->prev = p;
+    p->next = q;
+    return q;
+}
+
+void pop_back_linear(OldHistory* his){
+    OldCommand* p = his->begin;
+    OldCommand* q = NULL;
+    if(p==NULL){
+        return;
+    }
+    while(p->next != NULL){
+        q = p;
+        p = p->next;
+    }
+    if(q==NULL){
+        his->begin = NULL;
+    }else{
+        q->next = NULL;
+    }
+    free(p->str);
+    free(p);
+}
+
+void run_baseline(const size_t m, double* push, double* pop){
+    OldHistory his = {.begin = NULL};
+    const double t0 = now();
+    for(size_t i=0 ; i<m ; i++){
+        push_back_linear(&his, line);
+    }
+    const double t1 = now();
+    for(size_t i=0 ; i<m ; i++){
+        pop_back_linear(&his);
+    }
+    const double t2 = now();
+    *push = t1-t0;
+    *pop = t2-t1;
+}
+
+int main(int argc, char** argv){
+    size_t n = 1000000;
+    if(argc >= 2){
+        char* e;
+        n = strtoul(argv[1], &e, 10);
+        if(*e != '\0' || n == 0){
+            fprintf(stderr, "usage: %s [commands]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    double push;
+    double pop;
+    run_paint4(n, &push, &pop);
+    printf("paint4 History      %zu commands: push %.3f s, pop %.3f s\n", n, push, pop);
+
+    const size_t m = (n < baseline_limit) ? n : baseline_limit;
+    run_baseline(m, &push, &pop);
+    printf("baseline (old list) %zu commands: push %.3f s, pop %.3f s (measured)\n", m, push, pop);
+    if(m < n){
+        const double scale = ((double)n/m)*((double)n/m);
+        printf("baseline (old list) %zu commands: push %.3f s, pop %.3f s (extrapolated as n^2 from %zu measured)\n",
+               n, push*scale, pop*scale, m);
+    }
+    return 0;
+}
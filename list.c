@@ -11,16 +11,24 @@ struct node
 {
     char *str;
     Node *next;
+    Node *prev;
 };
 
 typedef struct list{
     Node* begin;
+    Node* end;
+    size_t count;
 } List;
 
 List* make_list(Node* begin){
     List* l = (List*)malloc(sizeof(List));
     Node* b = begin;
-    *l = (List){.begin = b};
+    *l = (List){.begin = b, .end = b, .count = 0};
+    //末尾と要素数を数えておく
+    for(Node* p = b ; p != NULL ; p = p->next){
+        l->end = p;
+        l->count++;
+    }
     return l;
 }
 
@@ -31,8 +39,14 @@ List *push_front(List* list, const char *str)
     char *s = (char *)malloc(strlen(str) + 1);
     strcpy(s, str);
     
-    *p = (Node){.str = s , .next = list->begin};
+    *p = (Node){.str = s , .next = list->begin, .prev = NULL};
+    if(list->begin != NULL){
+        list->begin->prev = p;
+    }else{
+        list->end = p;
+    }
     (list->begin) = p;
+    list->count++;
     return list; 
 }
 
@@ -45,6 +59,12 @@ List *pop_front(List* list)
     free(list->begin->str);
     free(list->begin);
     list->begin = p;
+    if(p != NULL){
+        p->prev = NULL;
+    }else{
+        list->end = NULL;
+    }
+    list->count--;
     return list;
 }
 
@@ -54,17 +74,16 @@ List *push_back(List* list, const char *str)
 	    return push_front(list, str);
     }
     
-    Node *p = list->begin;
-    while (p->next != NULL) {
-	    p = p->next;
-    }
+    Node *p = list->end;
     
     Node *q = (Node *)malloc(sizeof(Node));
     char *s = (char *)malloc(strlen(str) + 1);
     strcpy(s, str);
     
-    *q = (Node){.str = s, .next = NULL};
+    *q = (Node){.str = s, .next = NULL, .prev = p};
     p->next = q;
+    list->end = q;
+    list->count++;
     
     return list;
 }
@@ -74,17 +93,17 @@ List *pop_back(List* list)
 {
     // write an implementation.
     assert(list->begin != NULL);
-    Node* p = list->begin;
-    Node* pp = NULL;
-    while(p->next !=NULL){
-        pp = p;
-        p = p->next;
-    }
+    Node* p = list->end;
+    Node* pp = p->prev;
     free(p->str);
     free(p);
     if(pp!=NULL){
         pp->next = NULL;
+    }else{
+        list->begin = NULL;
     }
+    list->end = pp;
+    list->count--;
     return list;
 }
 
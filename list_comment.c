@@ -11,142 +11,183 @@ typedef struct node Node;
 
 // A node which belongs to a linear list
 // 線形リストの要素となる構造体
-struct node 
+// prev で一つ前の要素にも戻れるようにしておく (双方向リスト)
+struct node
 {
     char *str;
     Node *next;
+    Node *prev;
 };
 
+// The list itself: first element, last element and the number of elements
+// 先頭だけでなく末尾と要素数も持っておくと、末尾への追加・削除を辿らずに O(1) でできる
+typedef struct list
+{
+    Node *begin;
+    Node *end;
+    size_t count;
+} List;
+
 
 
 // 線形リストの先頭に新しくデータを追加 (push) する関数
 // 引数:
-// - 現在の線形リストの先頭へのポインタ (begin)
+// - 線形リストへのポインタ (list)
 // - 追加するべき文字列 (str)
 //
 // 出力:
-// - 新しく追加されたNodeへのポインタ（新しく先頭になる）
+// - 線形リストへのポインタ（list と同じ）
 //
-Node *push_front(Node *begin, const char *str)
+List *push_front(List *list, const char *str)
 {
     // Create a new element
     // 追加するデータのために構造体とその中身を確保
     Node *p = (Node *)malloc(sizeof(Node));
     char *s = (char *)malloc(strlen(str) + 1);
     strcpy(s, str); // 文字列をコピーする (str から s へ)
-    
-    // charポインタと次の行き先をメンバに持つ構造体とする
-    *p = (Node){.str = s, .next = begin};
-    
-    return p;  // Now the new element is the first element in the list
+
+    // charポインタと前後の行き先をメンバに持つ構造体とする
+    *p = (Node){.str = s, .next = list->begin, .prev = NULL};
+
+    // もともとの先頭の前に p をつなぐ。空だった場合は p が末尾にもなる
+    if (list->begin != NULL) {
+	list->begin->prev = p;
+    } else {
+	list->end = p;
+    }
+    list->begin = p;  // Now the new element is the first element in the list
+    list->count++;
+
+    return list;
 }
 
 // 線形リストの先頭からデータを取り除く (pop) する関数
 // 引数:
-// - 現在の線形リストの先頭へのポインタ (begin)
+// - 線形リストへのポインタ (list)
 //
 // 出力:
-// - 削除後に先頭になるNodeへのポインタ（もともと2番目だったもの）
+// - 線形リストへのポインタ（list と同じ）
 //
 
-Node *pop_front(Node *begin)
+List *pop_front(List *list)
 {
     // NULL のnext は当然指定できないので、現在、空の場合はとまる
-    assert(begin != NULL); // Don't call pop_front() when the list is empty
-    Node *p = begin->next; // 2番目のアドレスを確保（これをreturnする）
-    
-    free(begin->str);// 現在先頭の構造体の中身はfree
-    free(begin);// 構造体自体もfreeする
-    
-    return p;
+    assert(list->begin != NULL); // Don't call pop_front() when the list is empty
+    Node *p = list->begin->next; // 2番目のアドレスを確保（これが新しい先頭）
+
+    free(list->begin->str);// 現在先頭の構造体の中身はfree
+    free(list->begin);// 構造体自体もfreeする
+
+    // 2番目が先頭になる。要素がなくなった場合は末尾もNULLにする
+    if (p != NULL) {
+	p->prev = NULL;
+    } else {
+	list->end = NULL;
+    }
+    list->begin = p;
+    list->count--;
+
+    return list;
 }
 
 // 線形リストの末尾に新しくデータを追加 (push) する関数
 // 引数:
-// - 現在の線形リストの先頭へのポインタ (begin)
+// - 線形リストへのポインタ (list)
 // - 追加するべき文字列 (str)
 //
 // 出力:
-// - 線形リストの先頭へのポインタ（begin と同じ）
+// - 線形リストへのポインタ（list と同じ）
 //
 
-Node *push_back(Node *begin, const char *str)
+List *push_back(List *list, const char *str)
 {
     // 現状、空の場合は後ろには追加できないので、前に追加する
-    if (begin == NULL) {   // If the list is empty
-	return push_front(begin, str);
+    if (list->begin == NULL) {   // If the list is empty
+	return push_front(list, str);
     }
-    
-    // Find the last element
-    Node *p = begin;
-    // インデックス以外でforやwhile ループを回す方法の一つ
-    // 線形リストの場合はp->next で指定された次の構造体へのアドレスを順に辿ればいい
-    // 次の要素がNULL になっているものを見つけるまで続ける
-    while (p->next != NULL) {
-	p = p->next;
-    }
-    // ループを抜けた時点でpは現在、末尾の構造体を指している
-    
+
+    // The last element is kept in list->end
+    // 末尾は list->end に覚えているので、先頭から辿る必要はない
+    Node *p = list->end;
+
     // Create a new element
     // 追加する構造体用のメモリを確保する (このあたりはpush_frontの時と同じ)
     Node *q = (Node *)malloc(sizeof(Node));
     char *s = (char *)malloc(strlen(str) + 1);
     strcpy(s, str);
-    
-    //今回確保したものは末尾にあるので、nextがNULLをさすようにする
-    *q = (Node){.str =s, .next = NULL};
-    
+
+    //今回確保したものは末尾にあるので、nextがNULLを、prevがもとの末尾をさすようにする
+    *q = (Node){.str =s, .next = NULL, .prev = p};
+
     // The new element should be linked from the previous last element
-    // pからqにつなぐ
+    // pからqにつなぎ、qを新しい末尾とする
     p->next = q;
-    
-    return begin;
+    list->end = q;
+    list->count++;
+
+    return list;
 }
 
 // 実習1: pop_back の実装
 // 線形リストの末尾からデータを取り除く (pop) する関数
 // 引数:
-// - 現在の線形リストの先頭へのポインタ (begin)
+// - 線形リストへのポインタ (list)
 //
 // 出力:
-// - 新しく先頭になるNodeへのポインタ（begin と同じ）
+// - 線形リストへのポインタ（list と同じ）
 //
-Node *pop_back(Node *begin)
+List *pop_back(List *list)
 {
-    
-    // 頑張って実装する
-    return begin;
+    assert(list->end != NULL); // Don't call pop_back() when the list is empty
+
+    // 末尾の一つ前は prev で分かるので、これも辿らずに済む
+    Node *p = list->end;
+    Node *q = p->prev;
+
+    free(p->str);
+    free(p);
+
+    // 一つ前が新しい末尾になる。要素がなくなった場合は先頭もNULLにする
+    if (q != NULL) {
+	q->next = NULL;
+    } else {
+	list->begin = NULL;
+    }
+    list->end = q;
+    list->count--;
+
+    return list;
 }
 
 
-Node *remove_all(Node *begin)
+List *remove_all(List *list)
 {
-    while ((begin = pop_front(begin))) 
-	; // Repeat pop_front() until the list becomes empty
-    return begin;  // Now, begin is NULL
+    while (list->begin != NULL)
+	pop_front(list); // Repeat pop_front() until the list becomes empty
+    return list;  // Now, list->begin is NULL
 }
 
 int main()
 {
-    Node *begin = NULL; // pointer to the first element in the list
-    
+    List list = {.begin = NULL, .end = NULL, .count = 0}; // the list is empty at first
+
     // Read all lines from stdin and store them in the list
     char buf[maxlen];
     while (fgets(buf, maxlen, stdin)) {
-	//begin = push_front(begin, buf);
-	begin = push_back(begin, buf); // Try this instead of push_front()
+	//push_front(&list, buf);
+	push_back(&list, buf); // Try this instead of push_front()
     }
-    
-    //begin = pop_front(begin);  // What will happen if you do this?
-    //begin = pop_back(begin);   // What will happen if you do this?
-    
-    //begin = remove_all(begin); // What will happen if you do this?
-    
+
+    //pop_front(&list);  // What will happen if you do this?
+    //pop_back(&list);   // What will happen if you do this?
+
+    //remove_all(&list); // What will happen if you do this?
+
     // Print all the strings stored in the list
     // ポインタを辿ってfor文を回している。先頭アドレスからスタートして、アドレスをp->next がさす次の構造体へ更新し、NULL (終端) に当たるまで続ける
-    for (const Node *p = begin; p != NULL; p = p->next) {
+    for (const Node *p = list.begin; p != NULL; p = p->next) {
 	printf("%s", p->str);
     }
-    
+
     return 0;
 }
@@ -1,74 +1,612 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <limits.h>
 #include <ctype.h>
 #include <errno.h>
-#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <time.h>
+
+// キャンバスの1マス。文字と色(0または31-36)を並べて持つ
+typedef struct{
+    char ch;
+    unsigned char color;
+} Cell;
+
+// 1マス分の変更前の値
+// 大きなキャンバスでもy*width+xを作らずに済むよう、マスはタイルの番号とタイル内の位置で持つ
+typedef struct{
+    int tile;              //ty*tiles_x+tx (CANVAS_MAX_SIZEまでならintに収まる)
+    unsigned short offset; //タイル内の位置 (行優先)
+    Cell cell;
+} Diff;
+
+// タイルごと取っておいた変更前の内容 (大きく塗るコマンド用)
+// マスごとに記録すると塗った面積に比例して記録が増えるので、実行前のタイルを共有して持つ
+typedef struct{
+    int tile;        //ty*tiles_x+tx
+    struct tile* t;  //実行前のタイル (NULLなら空白)
+} TileDiff;
+
+// コマンド1つが書き換えたマスの記録
+// 1つのタイルはマスごと (diffs) かタイルごと (tiles) のどちらか一方だけで記録する
+typedef struct{
+    Diff* diffs;
+    size_t len;
+    size_t cap;
+    TileDiff* tiles;
+    size_t ntiles;
+    size_t tiles_cap;
+} Journal;
+
+// Historyの領域はchunk単位でまとめて確保し、先頭から切り出して使う
+// 履歴は末尾からしか削除しないので、確保位置を巻き戻すだけで解放できる
+typedef struct chunk{
+    struct chunk* prev;
+    size_t size;
+    size_t used;
+    char data[];
+} Chunk;
+
+typedef struct{
+    Chunk* top;
+} Arena;
+
+typedef struct{
+    Chunk* chunk;
+    size_t used;
+} ArenaMark;
+
+// キャンバスはTILE_SIZE四方のタイルに分けて持つ
+// タイルは参照カウントで共有し、共有されているタイルに書き込むときだけ複製する (copy-on-write)
+#define TILE_SHIFT 6
+#define TILE_SIZE (1<<TILE_SHIFT)
+#define TILE_MASK (TILE_SIZE-1)
+
+// タイルの中身 (8192バイト)。ファイルに対応付けたキャンバスではこのままファイルに並べるので、ページの境界に揃う
+typedef struct tile{
+    Cell cells[TILE_SIZE*TILE_SIZE]; //タイル内で行優先
+} Tile;
+
+// メモリに確保したタイル。参照カウントはタイルの外に置く
+// ファイル中のタイルは共有も解放もしないので参照カウントを持たない
+typedef struct{
+    int refs;
+    Tile tile;
+} HeapTile;
+
+// タイルはさらにBLOCK_SIZE四方ごとにまとめ、ブロックは初めて書き込むときに確保する
+// 確保していないブロックやタイル (NULL) は空白として扱うので、メモリは書き込んだ部分の分しか使わない
+#define BLOCK_SHIFT 6
+#define BLOCK_SIZE (1<<BLOCK_SHIFT)
+#define BLOCK_MASK (BLOCK_SIZE-1)
+
+typedef struct{
+    Tile* tiles[BLOCK_SIZE*BLOCK_SIZE]; //ブロック内で行優先。NULLなら空白
+    unsigned long long stamp[BLOCK_SIZE*BLOCK_SIZE]; //タイルごとの最後に書き込んだときの世代
+    unsigned long long journaled[BLOCK_SIZE*BLOCK_SIZE]; //最後に記録したコマンドの番号*2 (+1ならタイルごと記録した)
+} TileBlock;
+
+#define JOURNAL_TILE_SPAN (TILE_SIZE/2) //タイルの1行のうちこれ以上をまとめて塗るなら、タイルごと記録する
+
+#define CANVAS_MAX_SIZE 1000000 //縦横の大きさの上限 (ブロックの表と行ごとの変更範囲の大きさで決まる)
+#define FRAME_SIZE (64*1024)    //描画用のバッファがこれを超えたら途中で書き出す
+
+// resetで消えたタイルの、消える前の内容 (resetのundo用)
+// resetはタイルを実際には消さず、後からそのタイルに書き込むときに初めて空白のタイルに差し替えるので、
+// そのときに元のタイルをここに移す
+typedef struct resetsave{
+    unsigned long long from; //reset前の世代
+    unsigned long long to;   //reset後の世代
+    struct resetsave* prev;  //一つ前のreset
+    int n;                   //退避したタイルの数
+    int cap;
+    int (*slots)[2];         //退避したタイルの位置 (tx, ty)
+    Tile** tiles;            //退避したタイル
+} ResetSave;
+
+// ある時点のキャンバスの内容 (タイルを共有するので作るのはタイルの数に比例する時間で済む)
+typedef struct{
+    int width;
+    int height;
+    int blocks_x;
+    int blocks_y;
+    Tile*** blocks; //blocks[by*blocks_x+bx][block_slot(tx,ty)]。NULLなら空白
+} Snapshot;
+
+// ファイルに対応付けたキャンバス (-m) のヘッダ
+// ファイルはヘッダ、タイルの位置ごとの表 (ty*tiles_x+txの順)、タイルの本体ごとの位置の表、タイルの本体をこの順に並べたもの
+// タイルの本体は初めて書き込んだ順に後ろへ足していく (離れた位置に書くとファイルシステムの割り当てが遅いため)
+// 開くときは本体ごとの位置の表を使った分 (tiles_used個) だけ読むので、キャンバスの大きさによらない
+// このマシンのバイト順のまま読み書きする
+#define CANVAS_MAGIC "PCNV"
+#define CANVAS_VERSION 3 //1はタイルの本体の前に参照カウントを置いていた。2には本体ごとの位置の表がない
+#define CANVAS_ALIGN 4096 //タイルの本体の始まりの位置をこれに揃える
+
+typedef struct{
+    char magic[4];
+    int version;
+    int width;
+    int height;
+    char pen;
+    unsigned char color;
+    char reserved[6];
+    unsigned long long epoch;      //現在の世代
+    unsigned long long last_epoch; //これまでに使った最大の世代
+    unsigned long long tiles_used; //並べたタイルの本体の数
+} CanvasHeader;
+
+typedef struct{
+    unsigned long long stamp; //最後に書き込んだときの世代 (0なら書き込んだことがない)
+    unsigned long long tile;  //タイルの本体の番号
+} FileSlot;
 
 typedef struct{
     int width;
     int height;
-    char** canvas;
-    int** canvascolor;
+    int tiles_x; //横と縦のタイルの数
+    int tiles_y;
+    int blocks_x; //横と縦のブロックの数
+    int blocks_y;
+    TileBlock** blocks; //blocks[by*blocks_x+bx]。stampがepochと違うタイルは空白として扱う
+    unsigned long long epoch;  //現在の世代 (resetのたびに新しい値になる)
+    unsigned long long last_epoch; //これまでに使った最大の世代
+    ResetSave* reset; //現在の世代を作ったreset (なければNULL)
+    char* frame; //描画用のバッファ (FRAME_SIZEを超えたら途中で書き出す)
+    int* dirty_lo; //行ごとの前回描画から変更された範囲 (lo>hiなら変更なし)
+    int* dirty_hi;
+    int dirty_y0;  //変更のある行の範囲
+    int dirty_y1;
+    int all_dirty; //1なら全体が変更されている (resetなどで一度に立て、行ごとの範囲は見ない)
     char pen;
     char* color;
+    int colorcode; //colorを解決した値 (color_getterの結果)
+    Journal* journal; //NULLでなければ書き換えをここに記録する
+    unsigned long long journal_id; //journalに記録しているコマンドの番号 (記録を始めるたびに増やす)
+    CanvasHeader* header; //ファイルに対応付けていればその先頭 (なければNULL)
+    FileSlot* file_slot;  //ファイル中のタイルの位置ごとの表
+    unsigned long long* file_owner; //ファイル中のタイルの本体ごとの、それを使う位置 (ty*tiles_x+tx)
+    Tile* file_tiles;     //ファイル中のタイルの本体
+    size_t mapsize;       //対応付けた大きさ (全タイルを書き込んだときのファイルの大きさ)
+    size_t filesize;      //今のファイルの大きさ
+    int fd;
 } Canvas;
 
+// 入力行中の1語 (コピーせず位置と長さだけを持つ)
+typedef struct{
+    const char* s;
+    int len;
+} Token;
+
+// 履歴に残るコマンドを解釈済みの形で持つ
+typedef enum opcode{OP_LINE, OP_RECT, OP_CIRCLE, OP_FILL, OP_ERASE, OP_CHPEN, OP_CHCOLOR, OP_RESET,
+                    OP_FILLRECT, OP_FILLCIRCLE, OP_FILLPOLY, OP_POLYLINE, OP_POLYGON, OP_LOADCANVAS, OP_COUNT} Opcode;
+
+typedef struct{
+    unsigned char code; //Opcode
+    char ch;            //chpenの文字
+    int arg[4];         //座標など。chcolorでは色の値
+    int npoints;        //polyline, polygon, fillpolyの頂点の数
+    const int* points;  //頂点の座標 x0 y0 x1 y1 ... (履歴ではArenaに置く)
+    const char* name;   //loadcanvasのファイル名 (履歴ではArenaに置く)
+} Op;
+
 typedef struct command{
-    char* str;
-    size_t bufsize;
+    Op op;
+    ArenaMark mark; //このコマンドを確保する直前の位置
+    Journal journal;
+    char pen;            //実行前のpen (undo/redoで入れ替える)
+    unsigned char color; //実行前の色の値
+    ResetSave* reset;    //reset, loadcanvasコマンドなら退避したタイル
     struct command* next;
     struct command* prev;
 } Command;
 
+// -sで開いたセッション
+// チェックポイント (RLE形式のキャンバス) と、その後に実行したコマンドのログを組にして持つ
+// 起動時はチェックポイントを読んでからログの分だけを実行し直す
+typedef struct{
+    char checkpoint[FILENAME_MAX]; //prefix.rle
+    char log_name[FILENAME_MAX];   //prefix.log
+    FILE* log;
+    unsigned char generation; //チェックポイントを作るたびに1増やし、両方のヘッダに書く
+    size_t base;              //履歴の先頭のうちログにない (チェックポイントかLOG_CELLSに含まれる) コマンドの数
+    size_t redo_base;         //redoスタックの底のうちログにないものの数
+    int need_checkpoint;      //ログでは再現できない操作をしたので、次にチェックポイントを作る
+    unsigned long pending;    //fsyncしていない記録の数
+    struct timespec synced;   //最後にfsyncした時刻
+    long checkpoint_size;
+} Session;
+
 typedef struct {
     Command* begin;
+    Command* end;
+    size_t count;
+    Command* redo; //undoしたコマンドのスタック
+    size_t redo_count;
+    Arena arena;
+    Journal scratch; //実行中のコマンドの記録用
+    int* points;     //実行中のコマンドの頂点の座標
+    size_t points_cap;
+    Token* tokens;   //実行中のコマンドの語
+    size_t tokens_cap;
+    char name[FILENAME_MAX]; //実行中のコマンドのファイル名
+    Session* session;        //-sで開いたセッション (なければNULL)
 } History;
 
 Canvas* init_canvas(int width, int height, char pen);
+Canvas* open_canvas(const char* filename, int width, int height, char pen);
+void store_header(Canvas* c);
+void grow_file(Canvas* c);
 void reset_canvas(Canvas* c);
-void reset_canvascolor(Canvas* c);
+size_t render_canvas(Canvas* c);
+size_t render_dirty(Canvas* c);
 void print_canvas(Canvas* c);
+void print_dirty(Canvas* c);
+void mark_dirty(Canvas* c, const int x, const int y);
+void mark_all_dirty(Canvas* c);
+void clear_dirty(Canvas* c);
+void write_all(const char* buf, size_t len);
 void free_canvas(Canvas* c);
+void release_blocks(Canvas* c);
+char* flush_frame(Canvas* c, char* p);
+char* render_border(Canvas* c, char* p);
+const Cell* cell_at(Canvas* c, const int x, const int y);
+TileBlock** block_at(Canvas* c, const int tx, const int ty);
+int block_slot(const int tx, const int ty);
+const Tile* tile_read(Canvas* c, const int tx, const int ty);
+const Cell* tile_row(Canvas* c, const int x, const int y);
+Tile* tile_write(Canvas* c, const int tx, const int ty);
+void expire_tile(Canvas* c, TileBlock* b, const int tx, const int ty);
+Cell* cell_write(Canvas* c, const int x, const int y);
+Tile* new_tile(Canvas* c, const int tx, const int ty);
+Tile* alloc_tile(void);
+int* tile_refs(Tile* t);
+Tile* tile_share(Canvas* c, Tile* t);
+void tile_release(Tile* t);
+void set_stamp(Canvas* c, TileBlock* b, const int tx, const int ty, const unsigned long long stamp);
+void reset_tiles(Canvas* c);
+void undo_reset(Canvas* c, ResetSave* s);
+void redo_reset(Canvas* c, ResetSave* s);
+void free_reset(ResetSave* s);
+
+// 空白のタイル (確保していないタイルやresetで消えたタイルを読むときに返す)
+Tile blank_tile;
+
+Snapshot* take_snapshot(Canvas* c);
+const Tile* snapshot_tile(const Snapshot* s, const int tx, const int ty);
+void free_snapshot(Snapshot* s);
+void put_cell(Canvas* c, const int x, const int y, const char ch, const int color);
+void put_span(Canvas* c, const int y, int x0, int x1, const char ch, const int color);
+
+// Journalの操作
+void journal_add(Journal* j, const int tile, const int offset, const Cell cell);
+void journal_apply(Canvas* c, Journal* j, const int reverse);
+int journal_tile(Canvas* c, const int tx, const int ty, const int whole);
+void journal_swap_tile(Canvas* c, TileDiff* d);
+void journal_release(Journal* j);
+
+// Arenaの操作
+void* arena_alloc(Arena* a, size_t size);
+ArenaMark arena_mark(Arena* a);
+void arena_rewind(Arena* a, ArenaMark m);
+void arena_free(Arena* a);
 
 void rewind_screen(unsigned int line);
 void clear_command(void);
 void clear_screen(void);
 
+// 1なら途中経過のメッセージや画面制御を出さない (バッチ処理やloadの中身)
+int quiet = 0;
+// 直前にreport/report_errorで出したメッセージ
+char last_message[256];
+// 1ならバッチ処理 (statsのように表示だけするコマンドは結果を標準出力に出す)
+int batch_output = 0;
+// 今のコマンドでreport/report_errorが画面に出した行数 (折り返しも数える)
+unsigned int message_rows = 0;
+void report(const char* fmt, ...);
+void report_error(const char* fmt, ...);
+int terminal_width(void);
+unsigned int screen_rows(const char* s, const size_t len);
+unsigned int line_rows(const size_t n);
+
 // Historyの操作
-Command* push_back(History* his, const char* str, size_t bufsize);
+Command* push_back(History* his, const Op* op);
 Command* pop_back(History* his);
+void link_back(History* his, Command* p);
+void clear_redo(History* his);
+void swap_state(Canvas* c, Command* q);
+void free_history(History* his);
+void clear_history(History* his, Canvas* c);
+int* scratch_points(History* his, const size_t n);
+Token* scratch_tokens(History* his, const size_t n);
 
 typedef enum res{EXIT, NORMAL, COMMAND, UNKNOWN, ERROR} Result;
 
 int max(const int a, const int b);
+int min(const int a, const int b);
+
+// 半径ごとに中点アルゴリズムの結果を表にして使い回す
+// half[v]: 中心からv行目の輪郭の半幅 (v<=xmaxでは1/8円のx=vのときのy)
+typedef struct{
+    int r;
+    int xmax; //x<=yとなる最後のx
+    int half[];
+} CircleTable;
+
+#define CIRCLE_CACHE_RADIUS 1024 //これより大きい半径は表を作らず毎回計算する
+
+CircleTable* circle_cache[CIRCLE_CACHE_RADIUS+1];
+struct{
+    unsigned long hits;     //表を使い回した回数
+    unsigned long misses;   //表を作った回数
+    unsigned long uncached; //半径が大きく表を使わなかった回数
+    size_t bytes;           //表の大きさの合計
+} circle_stats;
+const CircleTable* circle_table(const int r);
+void free_circle_cache(void);
+
 void draw_line(Canvas* c, const int x0, const int y0, const int x1, const int y1);
+void draw_segment(Canvas* c, const int x0, const int y0, const int x1, const int y1, const int skip_first, const int skip_last);
+void draw_polyline(Canvas* c, const int* points, const int n, const int closed);
 void draw_rect(Canvas* c, const int x0, const int y0, const int w0, const int h0);
 void draw_circle(Canvas* c, const int x0, const int y0, const int r0);
+long long line_minor(const long long i, const long long major, const long long minor);
+long long first_step(long long lo, long long hi, const long long major, const long long minor, const long long k);
+long long isqrt(const long long n);
+long long circle_y(const long long r, const long long x);
+long long first_x_below(long long lo, long long hi, const long long r, const long long y, const CircleTable* t);
+void clip_range(const long long p0, const int s, const int size, long long* lo, long long* hi);
+void draw_octant(Canvas* c, const int x0, const int y0, const int r, const int octant, const long long xmax, const CircleTable* t);
 void search_for_fill(Canvas* c, int x0, int y0);
+void fill_rect(Canvas* c, const int x0, const int y0, const int w0, const int h0);
+void fill_circle(Canvas* c, const int x0, const int y0, const int r0);
+long long circle_xmax(const long long r);
+void fill_polygon(Canvas* c, const int* points, const int n);
+
+// fill_polygonの辺 (ytop<=y<ybottomとなる行yで交わる)
+typedef struct{
+    double ytop;
+    double ybottom;
+    double x;     //ytopでのx
+    double slope; //yが1増えたときのxの変化
+} Edge;
+int compare_edge(const void* a, const void* b);
+long long floor_ll(const double x);
 int color_getter(Canvas* c);
-Result interpret_command(const char* command, History* his, Canvas* c);
+const char* color_name(const int code);
+int valid_color(const int code);
+int valid_pen(const int ch);
+void set_color(Canvas* c, const char* color);
+void set_colorcode(Canvas* c, const int code);
+void apply_op(Canvas* c, const Op* op);
+void print_op(FILE* fp, const Op* op);
+
+// コマンドの解釈
+// p: 先頭nargs個の引数を整数として読んだもの, args/argc: コマンド名を除いた全引数
+// 履歴に残るコマンドはopに解釈結果を入れる
+typedef Result (*Handler)(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+
+typedef struct{
+    const char* name;
+    int len;   //strlen(name)
+    int nargs; //必要な整数引数の数
+    Handler handler;
+} CommandDesc;
+
+#define MAX_ARGS 4 //整数として読む引数の数 (CommandDescのnargs) の上限
+
+int tokenize(const char* line, History* his);
+int parse_int(const Token* t, int* value);
+const char* token_str(const Token* t, char* buf, const size_t size);
+const CommandDesc* find_command(const Token* verb);
+int command_hash(const char* name, const int len);
+
+// コマンド名のハッシュ表 (commandsの添字+1、0は空き)
+// 今のコマンド名はハッシュ値がすべて違うので、1回比べるだけで見つかる
+#define COMMAND_HASH_SIZE 64
+unsigned char command_table[COMMAND_HASH_SIZE];
+int command_table_ready = 0;
+Result interpret_command(const char* command, History* his, Canvas* c, Op* op);
+Result record_command(const char* command, History* his, Canvas* c);
+void record_op(const Op* op, History* his, Canvas* c);
+Command* store_command(History* his, Canvas* c, const Op* op, const char pen, const unsigned char color);
 void save_history(const char *filename, History* his);
 
+// バイナリ形式の履歴
+// ヘッダ (マジック"PHIS", 版, 予約3バイト, コマンド数(64bit LE)) の後に
+// 各コマンドをopcode 1バイト + 引数(zigzag符号化したvarint, chpenは1バイト) で並べる
+#define HISTORY_MAGIC "PHIS"
+#define HISTORY_VERSION 1
+#define HISTORY_HEADER_SIZE 16
+
+int op_nargs(const int code);
+void put_varint(FILE* fp, const int v);
+int get_varint(const unsigned char** p, const unsigned char* end, int* v);
+int save_history_binary(const char* filename, History* his);
+void put_op(FILE* fp, const Op* op);
+int get_op(const unsigned char** p, const unsigned char* end, History* his, Op* op);
+
+// RLE形式のキャンバス
+// ヘッダ (マジック"PRLE", 版, pen, 色, 世代, 幅と高さ(32bit LE)) の後に、
+// 全マスを行優先で1列に並べたときの同じマスの続き (長さのvarint, 文字1バイト, 色1バイト) を並べる
+// 続きは行をまたいでよく、長さの合計は幅*高さになる。世代はセッションのチェックポイントだけが使う (普通は0)
+#define CANVAS_RLE_MAGIC "PRLE"
+#define CANVAS_RLE_VERSION 1
+#define CANVAS_RLE_HEADER_SIZE 16
+
+void put_uvarint(FILE* fp, unsigned long long u);
+int get_uvarint(const unsigned char** p, const unsigned char* end, unsigned long long* u);
+int save_canvas_rle(const char* filename, Canvas* c, const int generation);
+int load_canvas_rle(Canvas* c, const char* filename, unsigned char* header);
+int decode_canvas_rle(Canvas* c, const unsigned char* p, const unsigned char* end, const unsigned long long total);
+
+// セッションのログ
+// ヘッダ (マジック"PLOG", 版, 世代, 予約2バイト, 幅と高さ(32bit LE)) の後に、
+// 履歴に積んだコマンドをバイナリ形式の履歴と同じ形で、undo/redoを1バイトで追記していく
+// チェックポイントより前のコマンドのundo/redoは、その結果のマスを書く (LOG_CELLS, put_log_cellsを参照)
+#define SESSION_LOG_MAGIC "PLOG"
+#define SESSION_LOG_VERSION 2 //1にはLOG_CELLSがない
+#define SESSION_LOG_HEADER_SIZE 16
+#define LOG_CELLS 0xfd //opcodeと重ならない値
+#define LOG_UNDO 0xfe
+#define LOG_REDO 0xff
+#define LOG_SYNC_COUNT 1024     //これだけ記録したらfsyncする
+#define LOG_SYNC_INTERVAL 1.0   //前のfsyncからこれだけ秒が経っていてもfsyncする
+#define LOG_COMPACT_MIN (1<<20) //ログがこれとチェックポイントの大きさの両方を超えたらチェックポイントを作り直す
+
+Session* open_session(const char* prefix, History* his, Canvas* c);
+void close_session(History* his, Canvas* c);
+int replay_log(const unsigned char** p, const unsigned char* end, History* his, Canvas* c, unsigned long* applied);
+void put_log_cells(FILE* fp, Canvas* c, const Journal* j);
+int get_log_cells(const unsigned char** p, const unsigned char* end, Canvas* c, const int apply);
+int write_log_header(Session* s, Canvas* c);
+int write_checkpoint(Session* s, History* his, Canvas* c);
+int sync_log(Session* s);
+void sync_dir(const char* path);
+void session_log_op(History* his, const Op* op);
+void session_log_undo(History* his, Canvas* c, const Command* q, const int code);
+void session_commit(History* his, Canvas* c, const int flush);
+
+// loadの結果 (実行できたコマンド数、エラーになったコマンド数と最初のエラー)
+typedef struct {
+    unsigned long applied;
+    unsigned long rejected;
+    unsigned long first_line;
+    char first_error[256];
+} LoadStats;
+void load_error(LoadStats* st, const unsigned long line);
+Result load_history_text(FILE* fp, History* his, Canvas* c, LoadStats* st);
+Result load_history_binary(const char* filename, History* his, Canvas* c, LoadStats* st);
+double elapsed_since(const struct timespec* t0);
+
+Result cmd_line(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_rect(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_circle(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_fill(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_erase(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_chpen(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_chcolor(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_save(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_savebin(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_load(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_undo(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_redo(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_reset(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_quit(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_fillrect(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_fillcircle(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_fillpoly(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_polyline(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_polygon(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_stats(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_savecanvas(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result cmd_loadcanvas(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op);
+Result parse_points(History* his, const Token* args, const int argc, const int minpoints, const int code, Op* op);
+
+// コマンド名から処理を引く表 (find_commandでハッシュ表から引く)
+const CommandDesc commands[] = {
+    {"line",    4, 4, cmd_line},
+    {"rect",    4, 4, cmd_rect},
+    {"circle",  6, 3, cmd_circle},
+    {"fill",    4, 2, cmd_fill},
+    {"erase",   5, 2, cmd_erase},
+    {"chpen",   5, 0, cmd_chpen},
+    {"chcolor", 7, 0, cmd_chcolor},
+    {"save",    4, 0, cmd_save},
+    {"savebin", 7, 0, cmd_savebin},
+    {"load",    4, 0, cmd_load},
+    {"undo",    4, 0, cmd_undo},
+    {"redo",    4, 0, cmd_redo},
+    {"reset",   5, 0, cmd_reset},
+    {"quit",    4, 0, cmd_quit},
+    {"fillrect",   8, 4, cmd_fillrect},
+    {"fillcircle",10, 3, cmd_fillcircle},
+    {"fillpoly",   8, 0, cmd_fillpoly},
+    {"polyline",   8, 0, cmd_polyline},
+    {"polygon",    7, 0, cmd_polygon},
+    {"stats",      5, 0, cmd_stats},
+    {"savecanvas",10, 0, cmd_savecanvas},
+    {"loadcanvas",10, 0, cmd_loadcanvas},
+    {NULL,      0, 0, NULL}
+};
+
+void run_interactive(History* his, Canvas* c);
+void run_batch(FILE* in, History* his, Canvas* c, const unsigned long interval);
+
 int main(int argc, char** argv){
-    const int bufsize = 1000;
-    History his = (History){.begin = NULL};
+    History his = (History){.begin = NULL, .end = NULL, .count = 0, .redo = NULL, .arena = {NULL}, .scratch = {0}};
     //入力のチェック
-    int width;
-    int height;
-    if(argc != 3){
-        fprintf(stderr, "usage: %s <width> <hieght>\n",argv[0]);
+    //標準入出力がどちらも端末でなければバッチ処理にする (-b/-tで指定も可)
+    int batch = !isatty(STDIN_FILENO) && !isatty(STDOUT_FILENO);
+    const char* script = NULL;
+    unsigned long interval = 0;
+    const char* mapfile = NULL;
+    const char* prefix = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "btf:i:m:s:")) != -1){
+        switch(opt){
+            case 'b':
+                batch = 1;
+                break;
+            case 't':
+                batch = 0;
+                break;
+            case 'f':
+                script = optarg;
+                batch = 1;
+                break;
+            case 'i':{
+                char* e;
+                interval = strtoul(optarg,&e,10);
+                if(*e != '\0'){
+                    fprintf(stderr, "%s: irregular character found %s\n",optarg,e);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'm':
+                mapfile = optarg;
+                break;
+            case 's':
+                prefix = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-b|-t] [-f script] [-i interval] [-m file | -s prefix] <width> <height>\n",argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    //-mのファイルと-sのセッションはどちらも絵を残すためのものなので、同時には使わない
+    if(mapfile != NULL && prefix != NULL){
+        fprintf(stderr, "error: -m and -s cannot be used together.\n");
         return EXIT_FAILURE;
-    }else{
+    }
+    //既存のファイルを-mで開くときは大きさを省略できる (0ならファイルに従う)
+    int width = 0;
+    int height = 0;
+    if(argc-optind != 2 && !(mapfile != NULL && argc == optind)){
+        fprintf(stderr, "usage: %s [-b|-t] [-f script] [-i interval] [-m file | -s prefix] <width> <height>\n",argv[0]);
+        return EXIT_FAILURE;
+    }else if(argc-optind == 2){
         char* e;
-        long w = strtol(argv[1],&e,10);
+        long w = strtol(argv[optind],&e,10);
         if(*e != '\0'){
-            fprintf(stderr, "%s: irregular character found %s\n",argv[1],e);
+            fprintf(stderr, "%s: irregular character found %s\n",argv[optind],e);
             return EXIT_FAILURE;
         }
-        long h = strtol(argv[2],&e,10);
+        long h = strtol(argv[optind+1],&e,10);
         if(*e != '\0'){
-            fprintf(stderr, "%s: irregular character found %s\n",argv[2],e);
+            fprintf(stderr, "%s: irregular character found %s\n",argv[optind+1],e);
+            return EXIT_FAILURE;
+        }
+        if(w <= 0 || h <= 0 || w > CANVAS_MAX_SIZE || h > CANVAS_MAX_SIZE){
+            fprintf(stderr, "canvas size must be between 1 and %d.\n", CANVAS_MAX_SIZE);
             return EXIT_FAILURE;
         }
         width = (int) w;
@@ -76,32 +614,107 @@ int main(int argc, char** argv){
     }
     char pen = '*';
 
-    char buf[bufsize];
-    Canvas* c = init_canvas(width, height,pen);
+    FILE* in = stdin;
+    if(script != NULL && (in = fopen(script, "r")) == NULL){
+        fprintf(stderr, "error: cannot open %s.\n", script);
+        return EXIT_FAILURE;
+    }
+    Canvas* c = (mapfile != NULL) ? open_canvas(mapfile, width, height, pen) : init_canvas(width, height,pen);
+    if(c != NULL && prefix != NULL && (his.session = open_session(prefix, &his, c)) == NULL){
+        free_history(&his);
+        free_canvas(c);
+        c = NULL;
+    }
+    if(c == NULL){
+        if(in != stdin){
+            fclose(in);
+        }
+        return EXIT_FAILURE;
+    }
+
+    if(batch){
+        run_batch(in, &his, c, interval);
+    }else{
+        run_interactive(&his, c);
+    }
+    if(in != stdin){
+        fclose(in);
+    }
+    close_session(&his, c);
+    free_history(&his);
+    free_canvas(c);
+    free_circle_cache();
+
+    return 0;
+}
+
+void run_interactive(History* his, Canvas* c){
+    //頂点の多いpolylineなども途中で切らないよう、1行全体を読む
+    char* buf = NULL;
+    size_t bufsize = 0;
 
     printf("\n");
     unsigned long count = 0;
     while(1){
         count++;
-        print_canvas(c);
-        printf("%zu > ",count);
-        fgets(buf, bufsize, stdin);
-        const Result r = interpret_command(buf, &his,c);
-        if(r == EXIT){
+        if(count == 1){
+            print_canvas(c);
+        }else{
+            print_dirty(c);
+        }
+        const int prompt = printf("%zu > ",count);
+        if(getline(&buf, &bufsize, stdin) < 0){
             break;
         }
-        if(r == NORMAL){
-            push_back(&his, buf, bufsize);
+        message_rows = 0;
+        const Result r = record_command(buf, his,c);
+        if(r == EXIT){
+            break;
         }
+        //対話モードでは1コマンドごとにログをOSに渡しておく
+        session_commit(his, c, 1);
 
-        rewind_screen(2);
+        //入力行とメッセージは折り返して何行にもなることがあるので、実際に使った行数だけ戻る
+        //その下を全部消してから最後のメッセージだけを入力行の次に出し直し、キャンバスの上端まで戻る
+        const unsigned int input_rows = line_rows(prompt+strcspn(buf, "\n"));
+        rewind_screen(input_rows+message_rows);
         clear_command();
-        rewind_screen(height+2);
+        printf("\e[J\n");
+        unsigned int rows = 1;
+        if(message_rows > 0){
+            fputs(last_message, stdout);
+            rows += screen_rows(last_message, strlen(last_message));
+        }
+        rewind_screen(rows+c->height+2);
     }
+    free(buf);
     clear_screen();
-    free_canvas(c);
+}
 
-    return 0;
+// コマンドを順に実行し、最後に (intervalが0でなければその回数ごとにも) キャンバスを出力する
+// エラーは行番号付きで標準エラー出力に出す
+void run_batch(FILE* in, History* his, Canvas* c, const unsigned long interval){
+    char* buf = NULL;
+    size_t bufsize = 0;
+    unsigned long count = 0;
+    quiet = 1;
+    batch_output = 1;
+    while(getline(&buf, &bufsize, in) >= 0){
+        count++;
+        const Result r = record_command(buf, his, c);
+        if(r == EXIT){
+            break;
+        }
+        session_commit(his, c, 0);
+        if(r == ERROR || r == UNKNOWN){
+            fprintf(stderr, "line %lu: %s", count, last_message);
+        }
+        if(interval > 0 && count%interval == 0){
+            print_canvas(c);
+        }
+    }
+    free(buf);
+    print_canvas(c);
 }
 
 
@@ -113,598 +726,3056 @@ Canvas* init_canvas(int width, int height, char pen){
     char* color = (char*)malloc(sizeof(char)*50);
     new->color = color;
     strcpy(new->color, "default");
-    new->canvas = (char**)malloc(width*sizeof(char*));
-    new->canvascolor = (int**)malloc(width*sizeof(int*));
-
-    char* tmp = (char*)malloc(width*height*sizeof(char));
-    memset(tmp, ' ', width*height*sizeof(char));
-    int* tmp2 = (int*)malloc(width*height*sizeof(int));
-    memset(tmp2, 0 , width*height*sizeof(int));
-    
-    for(int i=0 ; i<width ; i++){
-        new->canvas[i] = tmp+i*height;
-        new->canvascolor[i] = tmp2+i*height;
+    new->colorcode = 0;
+    new->tiles_x = (width+TILE_SIZE-1) >> TILE_SHIFT;
+    new->tiles_y = (height+TILE_SIZE-1) >> TILE_SHIFT;
+    new->blocks_x = (new->tiles_x+BLOCK_SIZE-1) >> BLOCK_SHIFT;
+    new->blocks_y = (new->tiles_y+BLOCK_SIZE-1) >> BLOCK_SHIFT;
+    new->blocks = (TileBlock**)calloc((size_t)new->blocks_x*new->blocks_y, sizeof(TileBlock*));
+    new->epoch = 0;
+    new->last_epoch = 0;
+    new->reset = NULL;
+    new->dirty_lo = (int*)malloc(height*sizeof(int));
+    new->dirty_hi = (int*)malloc(height*sizeof(int));
+    for(int y=0 ; y<height ; y++){
+        new->dirty_lo[y] = width;
+        new->dirty_hi[y] = -1;
     }
+    new->dirty_y0 = height;
+    new->dirty_y1 = -1;
+    reset_canvas(new);
+    //書き出すかどうかはタイルの境目ごとに調べるので、その間に書く分 (1タイル幅で全マスの色が変わる場合、
+    //1マスあたり色指定5バイト+文字1バイト、行ごとに枠と色戻しとカーソル移動) の余裕を持たせる
+    new->frame = (char*)malloc(FRAME_SIZE+TILE_SIZE*6+128);
     new->pen = pen;
+    new->journal = NULL;
+    new->journal_id = 0;
+    new->header = NULL;
+    new->file_slot = NULL;
+    new->file_owner = NULL;
+    new->file_tiles = NULL;
+    new->mapsize = 0;
+    new->filesize = 0;
+    new->fd = -1;
     return new;
 }
 
-void reset_canvas(Canvas* c){
-    const int width = c->width;
-    const int height = c->height;
-    memset(c->canvas[0], ' ', width*height*sizeof(char));
-}
-
-void reset_canvascolor(Canvas* c){
-    const int width = c->width;
-    const int height = c->height;
-    memset(c->canvascolor[0],0, width*height*sizeof(int));
-}
-
-void print_canvas(Canvas* c){
-    const int height = c->height;
-    const int width = c->width;
-    char** canvas = c->canvas;
-    int** canvascolor = c->canvascolor;
-    printf("+");
-    for(int x=0 ; x<width ; x++){
-        printf("-");
+// filenameに対応付けたキャンバスを返す。ファイルが空ならwidth x heightで作る
+// 開くときは書き込んだことのあるタイルを表から拾うだけで、タイルの本体は描画などで読むまでOSが読み込まない
+// 失敗したらメッセージを出してNULLを返す
+Canvas* open_canvas(const char* filename, int width, int height, char pen){
+    const int fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if(fd < 0){
+        fprintf(stderr, "error: cannot open %s.\n", filename);
+        return NULL;
+    }
+    struct stat sb;
+    if(fstat(fd, &sb) != 0){
+        fprintf(stderr, "error: cannot open %s.\n", filename);
+        close(fd);
+        return NULL;
+    }
+    const int created = (sb.st_size == 0);
+    CanvasHeader h;
+    if(created){
+        if(width == 0){
+            fprintf(stderr, "error: %s is empty; give the canvas size.\n", filename);
+            close(fd);
+            return NULL;
+        }
+        //ファイルの世代の0は書き込んだことがない印に使うので1から始める
+        h = (CanvasHeader){.version = CANVAS_VERSION, .width = width, .height = height, .pen = pen, .color = 0,
+                           .epoch = 1, .last_epoch = 1, .tiles_used = 0};
+        memcpy(h.magic, CANVAS_MAGIC, 4);
+    }else{
+        if((size_t)sb.st_size < sizeof(h) || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)
+           || memcmp(h.magic, CANVAS_MAGIC, 4) != 0 || h.version != CANVAS_VERSION
+           || h.width <= 0 || h.height <= 0 || h.width > CANVAS_MAX_SIZE || h.height > CANVAS_MAX_SIZE){
+            fprintf(stderr, "error: %s is not a canvas file.\n", filename);
+            close(fd);
+            return NULL;
+        }
+        if(width != 0 && (width != h.width || height != h.height)){
+            fprintf(stderr, "error: %s is %dx%d, not %dx%d.\n", filename, h.width, h.height, width, height);
+            close(fd);
+            return NULL;
+        }
     }
-    printf("+\n");
-    for(int y=0 ; y<height ; y++){
-        printf("|");
-        for(int x=0 ; x<width ; x++){
-            const char c = canvas[x][y];
-            switch(canvascolor[x][y]){
-                case 31:
-                    printf("\x1b[31m");
-                    break;
-                case 32:
-                    printf("\x1b[32m");
-                    break;
-                case 33:
-                    printf("\x1b[33m");
-                    break;
-                case 34:
-                    printf("\x1b[34m");
-                    break;
-                case 35:
-                    printf("\x1b[35m");
-                    break;
-                case 36:
-                    printf("\x1b[36m");
-                    break;
-                default:
-                    printf("\x1b[39m");
-            }
-            putchar(c);
-            printf("\x1b[39m");
-        }
-        printf("|\n");
-    }
-
-    printf("+");
-    for(int x=0 ; x<width ; x++){
-        printf("-");
-    }
-    printf("+\n");
-    fflush(stdout);
-}
-
-void free_canvas(Canvas* c){
-    free(c->canvas[0]);
-    free(c->canvas);
-    free(c);
-}
-
-
-void rewind_screen(unsigned int line){
-    printf("\e[%dA",line);
-}
 
-void clear_command(void){
-    printf("\e[2K");
+    Canvas* c = init_canvas(h.width, h.height, h.pen);
+    const size_t ntiles = (size_t)c->tiles_x*c->tiles_y;
+    const size_t tables = sizeof(CanvasHeader)+ntiles*(sizeof(FileSlot)+sizeof(unsigned long long));
+    const size_t offset = (tables+CANVAS_ALIGN-1)/CANVAS_ALIGN*CANVAS_ALIGN;
+    const size_t used = offset+h.tiles_used*sizeof(Tile);
+    //全タイルを書き込んだときの大きさで対応付けておき、ファイルはタイルを足すときに伸ばす
+    //新しいファイルは大きさを決めるだけで、書き込むまでディスクは使わない
+    c->mapsize = offset+ntiles*sizeof(Tile);
+    c->filesize = created ? offset : (size_t)sb.st_size;
+    if(created ? ftruncate(fd, offset) != 0 : (h.tiles_used > ntiles || c->filesize < used || c->filesize > c->mapsize)){
+        fprintf(stderr, "error: %s has a wrong size.\n", filename);
+        close(fd);
+        free_canvas(c);
+        return NULL;
+    }
+    void* map = mmap(NULL, c->mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED){
+        fprintf(stderr, "error: cannot map %s.\n", filename);
+        close(fd);
+        free_canvas(c);
+        return NULL;
+    }
+    c->fd = fd;
+    c->header = (CanvasHeader*)map;
+    c->file_slot = (FileSlot*)(c->header+1);
+    c->file_owner = (unsigned long long*)(c->file_slot+ntiles);
+    c->file_tiles = (Tile*)((char*)map+offset);
+    if(created){
+        *c->header = h;
+    }
+    c->epoch = h.epoch;
+    c->last_epoch = h.last_epoch;
+    set_colorcode(c, h.color);
+    //使った本体だけを順に見る (位置の表全体は読まない)
+    for(unsigned long long i=0 ; i<h.tiles_used ; i++){
+        const size_t slot = (size_t)c->file_owner[i];
+        if(slot >= ntiles){
+            fprintf(stderr, "error: %s is broken.\n", filename);
+            free_canvas(c);
+            return NULL;
+        }
+        const FileSlot* f = &c->file_slot[slot];
+        if(f->stamp == 0 || f->tile != i){
+            //本体を足した直後、世代を書く前に止まったときの本体は使わない (その位置は後で別の本体を足していることもある)
+            continue;
+        }
+        const int tx = (int)(slot%c->tiles_x);
+        const int ty = (int)(slot/c->tiles_x);
+        TileBlock** bp = block_at(c, tx, ty);
+        if(*bp == NULL){
+            *bp = (TileBlock*)calloc(1, sizeof(TileBlock));
+        }
+        (*bp)->tiles[block_slot(tx, ty)] = &c->file_tiles[f->tile];
+        (*bp)->stamp[block_slot(tx, ty)] = f->stamp;
+    }
+    return c;
 }
 
-void clear_screen(void){
-    printf("\e[2J");
+// penや色、世代をファイルのヘッダに書く (ファイルに対応付けていなければ何もしない)
+void store_header(Canvas* c){
+    if(c->header == NULL){
+        return;
+    }
+    c->header->pen = c->pen;
+    c->header->color = (unsigned char)c->colorcode;
+    c->header->epoch = c->epoch;
+    c->header->last_epoch = c->last_epoch;
 }
 
-
-// Historyの操作
-Command* push_back(History* his, const char* str, size_t bufsize){
-    Command* p = his->begin;
-    char* s = (char*)malloc(strlen(str)+1);
-    strcpy(s,str);
-    if(p==NULL){
-        p = (Command*)malloc(sizeof(Command));
-        *p = (Command){.bufsize = bufsize, .prev = NULL, .next = his->begin, .str = s};
-        his->begin = p;
-        return p;
+// タイルの本体をもう1つ足せるようにファイルを伸ばす (足りなくなるたびに倍にする)
+// 伸ばせなければ続けられないので終了する (それまでに書き込んだ内容はファイルに残っている)
+void grow_file(Canvas* c){
+    const size_t offset = (char*)c->file_tiles-(char*)c->header;
+    const size_t cap = (c->filesize-offset)/sizeof(Tile);
+    if(c->header->tiles_used < cap){
+        return;
     }
-    while(p->next != NULL){
-        p = p->next;
+    size_t size = offset+((cap < 64) ? 64 : cap*2)*sizeof(Tile);
+    size = (size < c->mapsize) ? size : c->mapsize;
+    if(ftruncate(c->fd, size) != 0){
+        fprintf(stderr, "error: cannot extend the canvas file.\n");
+        exit(EXIT_FAILURE);
     }
-    Command* q = (Command*)malloc(sizeof(Command));
-    *q = (Command){.str = s, .bufsize = bufsize, .next = NULL, .prev = p};
-    p->next = q;
-    return q; 
+    c->filesize = size;
 }
 
-Command* pop_back(History* his){
-    Command* p = his->begin;
-    Command* q = NULL;
-    if(p==NULL){
-        return NULL;
-    }
-    while(p->next != NULL){
-        q = p;
-        p = p->next;
+// 全タイルを手放して空白にする (書き込むときに初めて確保する)
+void reset_canvas(Canvas* c){
+    for(int i=0 ; i<TILE_SIZE*TILE_SIZE ; i++){
+        blank_tile.cells[i] = (Cell){.ch = ' ', .color = 0};
     }
+    release_blocks(c);
+    mark_all_dirty(c);
+}
 
-    if(q==NULL){
-        his->begin = p->next;
-        p->next = NULL;
-        free(p->str);
-        free(p);
+void release_blocks(Canvas* c){
+    const size_t n = (size_t)c->blocks_x*c->blocks_y;
+    for(size_t i=0 ; i<n ; i++){
+        TileBlock* b = c->blocks[i];
+        if(b == NULL){
+            continue;
+        }
+        //ファイル中のタイルは対応付けを外すときにまとめて手放す
+        for(int k=0 ; k<BLOCK_SIZE*BLOCK_SIZE && c->header == NULL ; k++){
+            tile_release(b->tiles[k]);
+        }
+        free(b);
+        c->blocks[i] = NULL;
     }
-    if(q!=NULL){
-        q->next = NULL;
-        free(p->str);
-        free(p);
+}
+
+// バッファがFRAME_SIZEを超えていれば書き出し、次に書く位置を返す
+char* flush_frame(Canvas* c, char* p){
+    if(p-c->frame >= FRAME_SIZE){
+        write_all(c->frame, p-c->frame);
+        return c->frame;
     }
     return p;
 }
 
-
-int max(const int a, const int b){
-    return (a>b) ? a:b;
+// 上下の枠を書く
+char* render_border(Canvas* c, char* p){
+    *p++ = '+';
+    for(int x=0 ; x<c->width ; x+=TILE_SIZE){
+        p = flush_frame(c, p);
+        const int n = (c->width-x < TILE_SIZE) ? c->width-x : TILE_SIZE;
+        memset(p, '-', n);
+        p += n;
+    }
+    *p++ = '+';
+    *p++ = '\n';
+    return p;
 }
 
-void draw_line(Canvas* c, const int x0, const int y0, const int x1, const int y1){
-    const int width = c->width;
+// キャンバス全体をc->frameに書き出し、最後に残った長さを返す
+// 大きなキャンバスではc->frameが溜まるたびに途中で書き出す
+// 色のエスケープシーケンスは隣のマスと色が変わるときだけ出す
+size_t render_canvas(Canvas* c){
     const int height = c->height;
-    char pen = c->pen;
+    const int width = c->width;
+    char* p = c->frame;
 
-    const int n = max(abs(x1-x0),abs(y1-y0));
-    c->canvas[x0][y0] = pen;
-    c->canvascolor[x0][y0] = color_getter(c);
-    for(int i=1 ; i<=n ; i++){
-        const int x = x0 + i*(x1-x0)/n;
-        const int y = y0 + i*(y1-y0)/n;
-        if(x>=0 && x<width && y>=0 && y<height){
-            c->canvas[x][y] = pen;
-            c->canvascolor[x][y] = color_getter(c);
+    p = render_border(c, p);
+    for(int y=0 ; y<height ; y++){
+        *p++ = '|';
+        const Cell* row = NULL;
+        int color = 0;
+        for(int x=0 ; x<width ; x++){
+            //タイルの境目で次のタイルの同じ行に移る
+            if((x & TILE_MASK) == 0){
+                p = flush_frame(c, p);
+                const Tile* t = tile_read(c, x >> TILE_SHIFT, y >> TILE_SHIFT);
+                //空白のタイルは1マスずつ見ずにまとめて書く
+                if(t == &blank_tile){
+                    const int n = (width-x < TILE_SIZE) ? width-x : TILE_SIZE;
+                    if(color != 0){
+                        memcpy(p, "\x1b[39m", 5);
+                        p += 5;
+                        color = 0;
+                    }
+                    memset(p, ' ', n);
+                    p += n;
+                    x += n-1;
+                    continue;
+                }
+                row = t->cells+((y & TILE_MASK) << TILE_SHIFT);
+            }
+            const Cell cell = row[x & TILE_MASK];
+            if(cell.color != color){
+                color = cell.color;
+                if(color >= 31 && color <= 36){
+                    memcpy(p, "\x1b[3", 3);
+                    p += 3;
+                    *p++ = '0'+color-30;
+                }else{
+                    memcpy(p, "\x1b[39", 4);
+                    p += 4;
+                }
+                *p++ = 'm';
+            }
+            *p++ = cell.ch;
+        }
+        if(color != 0){
+            memcpy(p, "\x1b[39m", 5);
+            p += 5;
         }
+        *p++ = '|';
+        *p++ = '\n';
     }
+    p = render_border(c, p);
+    return p-c->frame;
 }
 
-void draw_rect(Canvas* c, const int x0, const int y0, const int w0, const int h0){
-    const int width = c->width;
+// 前回描画から変更された部分だけをc->frameに書き出し、最後に残った長さを返す
+// カーソルはキャンバスの上枠の行頭にある前提で、最後にキャンバスの下の行の行頭へ移動する
+size_t render_dirty(Canvas* c){
     const int height = c->height;
-    char pen = c->pen;
+    char* p = c->frame;
+    int line = 0; //カーソルのある行 (上枠が0)
+    const int all = c->all_dirty;
 
-    //縦
-    for(int i=0 ; i<h0 ; i++){
-        const int x1 = x0;
-        const int y1 = y0+i;
-        const int x2 = x0+w0-1;
-        if(x1>=0 && x1<width && y1>=0 && y1<height){
-            c->canvas[x1][y1] = pen;
-            c->canvascolor[x1][y1] = color_getter(c);
+    for(int y=(all ? 0 : c->dirty_y0) ; y<=(all ? height-1 : c->dirty_y1) ; y++){
+        const int lo = all ? 0 : c->dirty_lo[y];
+        const int hi = all ? c->width-1 : c->dirty_hi[y];
+        if(lo > hi){
+            continue;
         }
-        if(x2>=0 && x2<width && y1>=0 && y1<height){
-            c->canvas[x2][y1] = pen;
-            c->canvascolor[x2][y1] = color_getter(c);
-        }
-    }
-    //横
-    for(int i=0 ; i<w0 ; i++){
-        const int x1 = x0+i;
-        const int y1 = y0;
-        const int y2 = y0+h0-1;
-        if(x1>=0 && x1<width && y1>=0 && y1<height){
-            c->canvas[x1][y1] = pen;
-            c->canvascolor[x1][y1] = color_getter(c);
+        p = flush_frame(c, p);
+        p += sprintf(p, "\x1b[%dB\x1b[%dG", y+1-line, lo+2);
+        line = y+1;
+        const Cell* row = NULL;
+        int color = 0;
+        for(int x=lo ; x<=hi ; x++){
+            if(row == NULL || (x & TILE_MASK) == 0){
+                p = flush_frame(c, p);
+                row = tile_row(c, x, y);
+            }
+            const Cell cell = row[x & TILE_MASK];
+            if(cell.color != color){
+                color = cell.color;
+                if(color >= 31 && color <= 36){
+                    memcpy(p, "\x1b[3", 3);
+                    p += 3;
+                    *p++ = '0'+color-30;
+                }else{
+                    memcpy(p, "\x1b[39", 4);
+                    p += 4;
+                }
+                *p++ = 'm';
+            }
+            *p++ = cell.ch;
         }
-        if(x1>=0 && x1<width && y2>=0 && y2<height){
-            c->canvas[x1][y2] = pen;
-            c->canvascolor[x1][y2] = color_getter(c);
+        if(color != 0){
+            memcpy(p, "\x1b[39m", 5);
+            p += 5;
         }
     }
+    p += sprintf(p, "\x1b[%dB\r", height+2-line);
+    return p-c->frame;
 }
 
-void draw_circle(Canvas* c, const int x0, const int y0, const int r0){
-    const int width = c->width;
-    const int height = c->height;
-    char pen = c->pen;
-    for(int x=x0-r0+1 ; x<=x0+r0-1 ; x++){
-        int miny = 0;
-        double minval = width*height;
-        for(int y=y0-r0+1 ; y<=y0+r0-1 ; y++){
-            double dx = x-x0;
-            double dy = y-y0;
-            double dis = sqrt(dx*dx+dy*dy);
-            if(fabs(dis-r0)<minval){
-                miny = y;
-                minval = dis-r0;
-            }
-        }
-        if(x>=0 && x<width && miny>=0 && miny<height){
-            c->canvas[x][(int)miny] = pen;
-            c->canvascolor[x][(int)miny] = color_getter(c);
-        }
-        double miny2 = 2*y0-miny;
-        if(x>=0 && x<width && miny2>=0 && miny2<height){
-            c->canvas[x][(int)miny2] = pen;
-            c->canvascolor[x][(int)miny2] = color_getter(c);
-        }
-        double y1 = (miny>miny2) ? miny:miny2;
-        double y2 = (miny>miny2) ? miny2:miny;
-        if(x==x0-r0+1 || x==x0+r0-1){
-            for(int y = y2 ; y<=y1 ; y++){
-                if(x>=0 && x<width && y>=0 && y<height){
-                    c->canvas[x][y] = pen;
-                    c->canvascolor[x][y] = color_getter(c);
-                }
-            }
-        }
-    }
-    
+void print_canvas(Canvas* c){
+    //printfで溜まっている分を先に出してから、なるべく大きな単位のwriteで書き出す
+    fflush(stdout);
+    const size_t len = render_canvas(c);
+    clear_dirty(c);
+    write_all(c->frame, len);
 }
 
-void search_for_fill(Canvas* c, int x0, int y0){
-    if(x0<0 || x0>c->width || y0<0 || y0>c->height){
+// print_canvasで描画済みの画面に対して、変更のあったところだけ描き直す
+void print_dirty(Canvas* c){
+    fflush(stdout);
+    const size_t len = render_dirty(c);
+    clear_dirty(c);
+    write_all(c->frame, len);
+}
+
+void mark_dirty(Canvas* c, const int x, const int y){
+    if(c->all_dirty){
         return;
     }
-    if(c->canvas[x0][y0]==c->pen){
-       return;
+    if(x < c->dirty_lo[y]){
+        c->dirty_lo[y] = x;
     }
-    c->canvas[x0][y0] = c->pen;
-    c->canvascolor[x0][y0] = color_getter(c);
-    int dr[4][2] = {{-1,0},{1,0},{0,-1},{0,1}};
-    int** q = (int**)malloc(sizeof(int*)*c->height * c->width*10);
-    int l = 1;
-    int now = 0;
-    int* p1 = (int*)malloc(2*sizeof(int));
-    p1[0] = x0;
-    p1[1] = y0;
-    q[0] = p1;
-    int dx, dy;
-    int check[c->width][c->height];
-    for(int i=0 ; i<c->width ; i++){
-        for(int j=0 ; j<c->height ; j++){
-            check[i][j] = 0;
-        }
-    }
-    check[x0][y0] = 1;
-    while(1){
-        if(now==l){
-            break;
-        }
-        int* p2 = q[now];
-        for(int i=0 ; i<4 ; i++){
-            dx = p2[0]+dr[i][0];
-            dy = p2[1]+dr[i][1];
-            if(dx<0 || dx>=c->width || dy<0 || dy>=c->height){
-                continue;
-            }
-            if(c->canvas[dx][dy]==c->pen || check[dx][dy]==1){
-                continue;
-            }
-            check[dx][dy] = 1;
-            c->canvas[dx][dy] = c->pen;
-            c->canvascolor[dx][dy] = color_getter(c);
-            int* p3 = (int*)malloc(2*sizeof(int));
-            p3[0] = dx;
-            p3[1] = dy;
-            q[l] = p3;
-            l++;
-        }
-        now++;
+    if(x > c->dirty_hi[y]){
+        c->dirty_hi[y] = x;
+    }
+    if(y < c->dirty_y0){
+        c->dirty_y0 = y;
     }
-    for(int i=0 ; i<l ; i++){
-        free(q[i]);
+    if(y > c->dirty_y1){
+        c->dirty_y1 = y;
     }
-    free(q);
 }
 
-int color_getter(Canvas* c){
-    char* co = c->color;
-    if(strcmp(co,"red")==0){
-        return 31;
-    }else if(strcmp(co, "green")==0){
-        return 32;
-    }else if(strcmp(co, "yellow")==0){
-        return 33;
-    }else if(strcmp(co, "blue")==0){
-        return 34;
-    }else if(strcmp(co, "magenta")==0){
-        return 35;
-    }else if(strcmp(co, "cyan")==0){
-        return 36;
-    }
-    return 0;
+// 行ごとの範囲には触らず印を立てるだけにして、resetなどを盤面の高さによらない時間で済ませる
+void mark_all_dirty(Canvas* c){
+    c->all_dirty = 1;
 }
 
-Result interpret_command(const char* command, History* his, Canvas* c){
-    char* buf = (char*)malloc(strlen(command)+1);
-    strcpy(buf,command);
-    buf[strlen(buf)-1] = 0;
-    const char* s = strtok(buf, " ");
-    
-    if(strcmp(s,"line") == 0){
-        int p[4] = {0};
-        char* b[4];
-        for(int i=0 ; i<4 ; i++){
-            b[i] = strtok(NULL," ");
-            if(b[i] == NULL){
-                clear_command();
-                printf("the number of point is not enough.\n");
-                return ERROR;
-            }
-        }
-        for(int i=0 ; i<4 ; i++){
-            char* e;
-            long v = strtol(b[i],&e,10);
-            if(*e != '\0'){
-                clear_command();
-                printf("Non-int value is included.\n");
-                return ERROR;
-            }
-            p[i] = (int)v;
-        }
-        draw_line(c,p[0],p[1],p[2],p[3]);
-        clear_command();
-        printf("1 line drawn\n");
-        return NORMAL;
+// 印を立てる前に記録した行の範囲はdirty_y0..dirty_y1に収まっているので、そこだけ戻す
+void clear_dirty(Canvas* c){
+    c->all_dirty = 0;
+    for(int y=c->dirty_y0 ; y<=c->dirty_y1 ; y++){
+        c->dirty_lo[y] = c->width;
+        c->dirty_hi[y] = -1;
     }
+    c->dirty_y0 = c->height;
+    c->dirty_y1 = -1;
+}
 
-    if(strcmp(s, "rect") == 0){
-        int p[4] = {0};
-        char* b[4];
-        for(int i=0 ; i<4 ; i++){
-            b[i] = strtok(NULL," ");
-            if(b[i] == NULL){
-                clear_command();
-                printf("the number of point is not enough.\n");
-                return ERROR;
+void write_all(const char* buf, size_t len){
+    while(len > 0){
+        const ssize_t n = write(STDOUT_FILENO, buf, len);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
             }
+            return;
         }
-        for(int i=0 ; i<4 ; i++){
-            char* e;
-            long v = strtol(b[i],&e,10);
-            if(*e != '\0'){
-                clear_command();
-                printf("Non-int value is included.\n");
-                return ERROR;
-            }
-            p[i] = (int)v;
+        buf += n;
+        len -= n;
+    }
+}
+
+void free_canvas(Canvas* c){
+    release_blocks(c);
+    free(c->blocks);
+    if(c->header != NULL){
+        //閉じる前にヘッダとタイルをファイルに書き出しておく
+        store_header(c);
+        if(msync(c->header, c->filesize, MS_SYNC) != 0){
+            fprintf(stderr, "warning: cannot write the canvas file.\n");
         }
-        draw_rect(c,p[0],p[1],p[2],p[3]);
-        clear_command();
-        printf("1 rectangle drawn\n");
-        return NORMAL;
+        munmap(c->header, c->mapsize);
+    }
+    if(c->fd >= 0){
+        close(c->fd);
     }
+    free(c->dirty_lo);
+    free(c->dirty_hi);
+    free(c->frame);
+    free(c->color);
+    free(c);
+}
 
-    if(strcmp(s, "circle") == 0){
-        int p[3] = {0};
-        char* b[3];
-        for(int i=0 ; i<3 ; i++){
-            b[i] = strtok(NULL," ");
-            if(b[i] == NULL){
-                clear_command();
-                printf("the number of point is not enough.\n");
-                return ERROR;
-            }
+const Cell* cell_at(Canvas* c, const int x, const int y){
+    return &tile_read(c, x >> TILE_SHIFT, y >> TILE_SHIFT)->cells[((y & TILE_MASK) << TILE_SHIFT) | (x & TILE_MASK)];
+}
+
+Cell* cell_write(Canvas* c, const int x, const int y){
+    return &tile_write(c, x >> TILE_SHIFT, y >> TILE_SHIFT)->cells[((y & TILE_MASK) << TILE_SHIFT) | (x & TILE_MASK)];
+}
+
+// タイル(tx,ty)を含むブロックの、表の中の位置
+TileBlock** block_at(Canvas* c, const int tx, const int ty){
+    return &c->blocks[(size_t)(ty >> BLOCK_SHIFT)*c->blocks_x+(tx >> BLOCK_SHIFT)];
+}
+
+// ブロックの中でのタイル(tx,ty)の位置
+int block_slot(const int tx, const int ty){
+    return ((ty & BLOCK_MASK) << BLOCK_SHIFT) | (tx & BLOCK_MASK);
+}
+
+// タイルを読む。確保していないタイルやresetで消えているタイルなら空白のタイルを返す
+const Tile* tile_read(Canvas* c, const int tx, const int ty){
+    const TileBlock* b = *block_at(c, tx, ty);
+    if(b == NULL){
+        return &blank_tile;
+    }
+    const int i = block_slot(tx, ty);
+    return (b->tiles[i] != NULL && b->stamp[i] == c->epoch) ? b->tiles[i] : &blank_tile;
+}
+
+// (x,y)を含むタイルのy行目の先頭 (row[x & TILE_MASK]が(x,y)になる)
+const Cell* tile_row(Canvas* c, const int x, const int y){
+    return tile_read(c, x >> TILE_SHIFT, y >> TILE_SHIFT)->cells+((y & TILE_MASK) << TILE_SHIFT);
+}
+
+// タイルに書き込む準備をする
+// 確保していないタイルは空白で確保する
+// resetで消えているタイルは空白のタイルに差し替え、元のタイルはundoで戻りうるresetがあればそこで共有する
+// 他と共有しているタイルは複製してから返す
+Tile* tile_write(Canvas* c, const int tx, const int ty){
+    TileBlock** bp = block_at(c, tx, ty);
+    if(*bp == NULL){
+        *bp = (TileBlock*)calloc(1, sizeof(TileBlock));
+    }
+    TileBlock* b = *bp;
+    const int i = block_slot(tx, ty);
+    expire_tile(c, b, tx, ty);
+    Tile* t = b->tiles[i];
+    if(t == NULL){
+        t = new_tile(c, tx, ty);
+        b->tiles[i] = t;
+        set_stamp(c, b, tx, ty, c->epoch);
+    }else if(c->header == NULL && *tile_refs(t) > 1){
+        Tile* copy = alloc_tile();
+        memcpy(copy->cells, t->cells, sizeof(copy->cells));
+        (*tile_refs(t))--;
+        b->tiles[i] = copy;
+        t = copy;
+    }
+    return t;
+}
+
+// resetで消えているタイルを外してNULLにする
+// 元のタイルはundoで戻りうるresetがあればそこで共有する
+void expire_tile(Canvas* c, TileBlock* b, const int tx, const int ty){
+    const int i = block_slot(tx, ty);
+    if(b->tiles[i] != NULL && b->stamp[i] != c->epoch){
+        //fromは前のresetほど小さいので、タイルの世代より小さくなったら探すのをやめる
+        ResetSave* s = c->reset;
+        while(s != NULL && s->from > b->stamp[i]){
+            s = s->prev;
         }
-        for(int i=0 ; i<3 ; i++){
-            char* e;
-            long v = strtol(b[i],&e,10);
-            if(*e != '\0'){
-                clear_command();
-                printf("Non-int value is included.\n");
-                return ERROR;
+        if(s != NULL && b->stamp[i] == s->from){
+            if(s->n == s->cap){
+                s->cap = (s->cap == 0) ? 16 : s->cap*2;
+                s->slots = realloc(s->slots, s->cap*sizeof(*s->slots));
+                s->tiles = (Tile**)realloc(s->tiles, s->cap*sizeof(Tile*));
             }
-            p[i] = (int)v;
+            s->slots[s->n][0] = tx;
+            s->slots[s->n][1] = ty;
+            s->tiles[s->n] = tile_share(c, b->tiles[i]);
+            s->n++;
         }
-        draw_circle(c,p[0],p[1],p[2]);
-        clear_command();
-        printf("1 circle drawn\n");
-        return NORMAL;
+        if(c->header == NULL){
+            tile_release(b->tiles[i]);
+        }
+        b->tiles[i] = NULL;
     }
+}
 
-    if(strcmp(s, "fill") == 0){
-        int p[2] = {0};
-        char* b[2];
-        for(int i=0 ; i<2 ; i++){
-            b[i] = strtok(NULL," ");
-            if(b[i] == NULL){
-                clear_command();
-                printf("the number of point is not enough.\n");
-                return ERROR;
-            }
+// 空白のタイルを作る。ファイルに対応付けていれば、その位置のタイルの本体をファイル中に用意して使う
+// ファイルに対応付けたキャンバスのブロックには必ずファイル中のタイルを置き、共有も解放もしない
+Tile* new_tile(Canvas* c, const int tx, const int ty){
+    Tile* t;
+    if(c->header != NULL){
+        //resetで消えたタイルなど、前に書き込んだことのある位置は同じ本体を使い回す
+        FileSlot* f = &c->file_slot[(size_t)ty*c->tiles_x+tx];
+        if(f->stamp == 0){
+            grow_file(c);
+            c->file_owner[c->header->tiles_used] = (size_t)ty*c->tiles_x+tx;
+            f->tile = c->header->tiles_used++;
         }
-        for(int i=0 ; i<2 ; i++){
-            char* e;
-            long v = strtol(b[i],&e,10);
-            if(*e != '\0'){
-                clear_command();
-                printf("Non-int value is included.\n");
-                return ERROR;
-            }
-            p[i] = (int)v;
+        t = &c->file_tiles[f->tile];
+    }else{
+        t = alloc_tile();
+    }
+    memcpy(t->cells, blank_tile.cells, sizeof(t->cells));
+    return t;
+}
+
+// メモリにタイルを確保する (参照カウントは1、中身は未初期化)
+Tile* alloc_tile(void){
+    HeapTile* h = (HeapTile*)malloc(sizeof(HeapTile));
+    h->refs = 1;
+    return &h->tile;
+}
+
+// メモリに確保したタイルの参照カウント
+int* tile_refs(Tile* t){
+    return &((HeapTile*)((char*)t-offsetof(HeapTile, tile)))->refs;
+}
+
+// キャンバスのタイルを共有する。ファイル中のタイルはその場で書き換わるので、共有せずに複製を渡す
+Tile* tile_share(Canvas* c, Tile* t){
+    if(c->header != NULL){
+        Tile* copy = alloc_tile();
+        memcpy(copy->cells, t->cells, sizeof(copy->cells));
+        return copy;
+    }
+    (*tile_refs(t))++;
+    return t;
+}
+
+// メモリに確保したタイルを手放す (ファイル中のタイルには使わない)
+void tile_release(Tile* t){
+    if(t != NULL && --*tile_refs(t) == 0){
+        free((char*)t-offsetof(HeapTile, tile));
+    }
+}
+
+// タイルの世代を変える。ファイルに対応付けていればファイルの表も書き換える
+void set_stamp(Canvas* c, TileBlock* b, const int tx, const int ty, const unsigned long long stamp){
+    b->stamp[block_slot(tx, ty)] = stamp;
+    if(c->header != NULL){
+        c->file_slot[(size_t)ty*c->tiles_x+tx].stamp = stamp;
+    }
+}
+
+// 世代を進めるだけで全体を消す (タイルは書き込むときにtile_writeで差し替える)
+void reset_tiles(Canvas* c){
+    ResetSave* s = (ResetSave*)malloc(sizeof(ResetSave));
+    *s = (ResetSave){.from = c->epoch, .to = ++c->last_epoch, .prev = c->reset, .n = 0, .cap = 0, .slots = NULL, .tiles = NULL};
+    c->epoch = s->to;
+    c->reset = s;
+    mark_all_dirty(c);
+}
+
+// resetの前の世代に戻し、退避したタイルを書き戻す
+// resetの後に書き込んだマスはundo済みで空白なので、世代が戻れば退避していないタイルも元通りになる
+void undo_reset(Canvas* c, ResetSave* s){
+    for(int i=0 ; i<s->n ; i++){
+        //退避したときに確保したブロックなので必ずある
+        TileBlock* b = *block_at(c, s->slots[i][0], s->slots[i][1]);
+        const int k = block_slot(s->slots[i][0], s->slots[i][1]);
+        if(c->header != NULL){
+            //ファイル中のタイルはそのまま使い、中身だけを書き戻す
+            memcpy(b->tiles[k]->cells, s->tiles[i]->cells, sizeof(b->tiles[k]->cells));
+            tile_release(s->tiles[i]);
+        }else{
+            tile_release(b->tiles[k]);
+            b->tiles[k] = s->tiles[i];
         }
-        search_for_fill(c,p[0],p[1]);
-        clear_command();
-        printf("fill (%d,%d)\n",p[0],p[1]);
-        return NORMAL;
-    }
-    
-    if(strcmp(s, "erase") == 0){
-        int p[2] = {0};
-        char* b[2];
-        for(int i=0 ; i<2 ; i++){
-            b[i] = strtok(NULL," ");
-            if(b[i] == NULL){
-                clear_command();
-                printf("the number of point is not enough.\n");
-                return ERROR;
-            }
-        }
-        for(int i=0 ; i<2 ; i++){
-            char* e;
-            long v = strtol(b[i],&e,10);
-            if(*e != '\0'){
-                clear_command();
-                printf("Non-int value is included.\n");
-                return ERROR;
-            }
-            p[i] = (int)v;
-        }
-        if(p[0]<0 || p[0]>=c->width || p[1]<0 || p[1]>=c->height){
-            clear_command();
-            printf("out of range\n");
-            return ERROR;
+        set_stamp(c, b, s->slots[i][0], s->slots[i][1], s->from);
+    }
+    s->n = 0;
+    c->epoch = s->from;
+    c->reset = s->prev;
+    mark_all_dirty(c);
+}
+
+void redo_reset(Canvas* c, ResetSave* s){
+    c->epoch = s->to;
+    c->reset = s;
+    mark_all_dirty(c);
+}
+
+void free_reset(ResetSave* s){
+    if(s != NULL){
+        for(int i=0 ; i<s->n ; i++){
+            tile_release(s->tiles[i]);
         }
-        (c->canvas)[p[0]][p[1]] = ' ';
-        (c->canvascolor)[p[0]][p[1]] = 0;
-        clear_command();
-        printf("erase (%d,%d)\n",p[0],p[1]);
-        return NORMAL;
-    }
-    
-    if(strcmp(s, "chpen") == 0){
-        s = strtok(NULL, " ");
-        if(s==NULL){
-            clear_command();
-            printf("not include new pen\n");
-            return ERROR;
+        free(s->slots);
+        free(s->tiles);
+        free(s);
+    }
+}
+
+// タイルの参照を増やすだけで今の内容を取っておく (確保したブロックの数に比例する時間で済む)
+// ファイルに対応付けたキャンバスではタイルを複製するので、書き込んだ部分の大きさに比例する
+Snapshot* take_snapshot(Canvas* c){
+    Snapshot* s = (Snapshot*)malloc(sizeof(Snapshot));
+    const size_t n = (size_t)c->blocks_x*c->blocks_y;
+    *s = (Snapshot){.width = c->width, .height = c->height, .blocks_x = c->blocks_x, .blocks_y = c->blocks_y};
+    s->blocks = (Tile***)calloc(n, sizeof(Tile**));
+    for(size_t i=0 ; i<n ; i++){
+        const TileBlock* b = c->blocks[i];
+        if(b == NULL){
+            continue;
         }
-        if(strlen(s)!=1){
-            clear_command();
-            fprintf(stderr, "error: %s is not \"one\" character.\n",s);
-            return ERROR;
+        s->blocks[i] = (Tile**)malloc(BLOCK_SIZE*BLOCK_SIZE*sizeof(Tile*));
+        for(int k=0 ; k<BLOCK_SIZE*BLOCK_SIZE ; k++){
+            Tile* t = (b->stamp[k] == c->epoch) ? b->tiles[k] : NULL;
+            s->blocks[i][k] = (t != NULL) ? tile_share(c, t) : NULL;
         }
-        char past = c->pen;
-        c->pen = s[0];
-        clear_command();
-        printf("pen changed: %c -> %c\n",past, c->pen);
-        return NORMAL;
     }
+    return s;
+}
 
-    if(strcmp(s, "chcolor") == 0){
-        s = strtok(NULL, " ");
-        if(s==NULL){
-            clear_command();
-            printf("fill color name\n");
-            return ERROR;
+// スナップショットのタイルを読む。空白なら空白のタイルを返す
+const Tile* snapshot_tile(const Snapshot* s, const int tx, const int ty){
+    Tile** b = s->blocks[(size_t)(ty >> BLOCK_SHIFT)*s->blocks_x+(tx >> BLOCK_SHIFT)];
+    return (b != NULL && b[block_slot(tx, ty)] != NULL) ? b[block_slot(tx, ty)] : &blank_tile;
+}
+
+void free_snapshot(Snapshot* s){
+    const size_t n = (size_t)s->blocks_x*s->blocks_y;
+    for(size_t i=0 ; i<n ; i++){
+        if(s->blocks[i] == NULL){
+            continue;
         }
-        strcpy(c->color,s);
-        if(strcmp(s,"red")!=0 && strcmp(s,"green")!=0 && strcmp(s,"yellow")!=0 && strcmp(s,"blue")!=0 && strcmp(s,"magenta")!=0 && strcmp(s,"cyan")!=0 ){
-            clear_command();
-            printf("color not registered: %s\n",s);
-        }else{
-            clear_command();
-            printf("color changed: to %s\n",s);
+        for(int k=0 ; k<BLOCK_SIZE*BLOCK_SIZE ; k++){
+            tile_release(s->blocks[i][k]);
         }
-        return NORMAL;
+        free(s->blocks[i]);
     }
+    free(s->blocks);
+    free(s);
+}
 
-    if(strcmp(s, "save") == 0){
-        s = strtok(NULL, " ");
-        save_history(s, his);
-        printf("saved as \"%s\"\n", (s==NULL) ? "history.txt":s);
-        return COMMAND;
+void put_cell(Canvas* c, const int x, const int y, const char ch, const int color){
+    const Cell* q = cell_at(c, x, y);
+    if(q->ch == ch && q->color == color){
+        return;
     }
+    const int tx = x >> TILE_SHIFT;
+    const int ty = y >> TILE_SHIFT;
+    const int cells = c->journal != NULL && journal_tile(c, tx, ty, 0);
+    Cell* p = cell_write(c, x, y);
+    if(cells){
+        journal_add(c->journal, ty*c->tiles_x+tx, ((y & TILE_MASK) << TILE_SHIFT) | (x & TILE_MASK), *p);
+    }
+    *p = (Cell){.ch = ch, .color = (unsigned char)color};
+    mark_dirty(c, x, y);
+}
 
-    if(strcmp(s,"load") == 0){
-        s = strtok(NULL, " ");
-        const char* default_history_file = "history.txt";
-        if(s == NULL){
-            s = default_history_file;
-        }
-
-        FILE* fp;
-        if((fp = fopen(s, "r")) == NULL){
-            clear_command();
-            fprintf(stderr, "error: cannot open %s.\n", s);
-            return ERROR;
-        } 
-        const int bufsize = 1000;
-        char* buf2 = (char*) malloc(bufsize+1);
-        unsigned long count = 0;
-        while(fgets(buf2, bufsize, fp) != NULL){
-            const Result r = interpret_command(buf2, his,c);
-            if(r == EXIT){
-                break;
+// y行目のx0からx1までを塗る (キャンバスの外の部分は無視する)
+void put_span(Canvas* c, const int y, int x0, int x1, const char ch, const int color){
+    if(y < 0 || y >= c->height){
+        return;
+    }
+    x0 = (x0 > 0) ? x0 : 0;
+    x1 = (x1 < c->width-1) ? x1 : c->width-1;
+    if(x0 > x1){
+        return;
+    }
+    const Cell cell = {.ch = ch, .color = (unsigned char)color};
+    const int ty = y >> TILE_SHIFT;
+    const int offset = (y & TILE_MASK) << TILE_SHIFT;
+    int lo = x1+1;
+    int hi = x0-1;
+    //タイルごとに区切り、変わるマスがあったときだけそのタイルを書き込み用にする
+    for(int tx=x0 >> TILE_SHIFT ; tx<=x1 >> TILE_SHIFT ; tx++){
+        const int a = (x0 > tx << TILE_SHIFT) ? x0 : tx << TILE_SHIFT;
+        const int b = (x1 < (tx << TILE_SHIFT)+TILE_MASK) ? x1 : (tx << TILE_SHIFT)+TILE_MASK;
+        const Cell* row = tile_read(c, tx, ty)->cells+offset;
+        Cell* w = NULL;
+        int cells = 0;
+        for(int x=a ; x<=b ; x++){
+            const Cell old = row[x & TILE_MASK];
+            if(old.ch == ch && old.color == cell.color){
+                continue;
             }
-            if(r == NORMAL){
-                push_back(his, buf2, bufsize);
+            if(w == NULL){
+                //書き込み用にする前に記録の仕方を決める (タイルごとなら実行前のタイルを共有する)
+                cells = c->journal != NULL && journal_tile(c, tx, ty, b-a+1 >= JOURNAL_TILE_SPAN);
+                w = tile_write(c, tx, ty)->cells+offset;
+                row = w;
             }
-            rewind_screen(1);
+            if(cells){
+                journal_add(c->journal, ty*c->tiles_x+tx, offset | (x & TILE_MASK), old);
+            }
+            w[x & TILE_MASK] = cell;
+            lo = (x < lo) ? x : lo;
+            hi = x;
         }
-        clear_command();
-        printf("%s is loaded.\n",s);
-        fclose(fp);
-        return COMMAND;
     }
+    if(lo <= hi){
+        mark_dirty(c, lo, y);
+        mark_dirty(c, hi, y);
+    }
+}
 
-    if(strcmp(s, "undo") == 0){
-        reset_canvas(c);
-        reset_canvascolor(c);
-        Command* p = his->begin;
-        if(p != NULL){
-            while(p->next != NULL){
-                interpret_command((p->str), his, c);
-                p = p->next;
-                rewind_screen(1);
-            }
-            pop_back(his);
+
+// Journalの操作
+void journal_add(Journal* j, const int tile, const int offset, const Cell cell){
+    if(j->len == j->cap){
+        j->cap = (j->cap == 0) ? 64 : j->cap*2;
+        j->diffs = (Diff*)realloc(j->diffs, j->cap*sizeof(Diff));
+    }
+    j->diffs[j->len++] = (Diff){.tile = tile, .offset = (unsigned short)offset, .cell = cell};
+}
+
+// 記録されている値とキャンバスの値を入れ替える
+// undoでは逆順、redoでは正順に適用すると同じ記録で行き来できる
+// タイルごとの記録はマスごとの記録と別のタイルなので、順番によらない
+void journal_apply(Canvas* c, Journal* j, const int reverse){
+    for(size_t k=0 ; k<j->ntiles ; k++){
+        journal_swap_tile(c, &j->tiles[k]);
+    }
+    //続くマスは同じタイルにあることが多いので、直前のタイルを使い回す
+    int tile = -1;
+    int tx = 0;
+    int ty = 0;
+    Tile* t = NULL;
+    for(size_t k=0 ; k<j->len ; k++){
+        Diff* d = &j->diffs[reverse ? j->len-1-k : k];
+        if(d->tile != tile){
+            tile = d->tile;
+            tx = tile%c->tiles_x;
+            ty = tile/c->tiles_x;
+            t = tile_write(c, tx, ty);
+        }
+        const int x = (tx << TILE_SHIFT) | (d->offset & TILE_MASK);
+        const int y = (ty << TILE_SHIFT) | (d->offset >> TILE_SHIFT);
+        Cell* p = &t->cells[d->offset];
+        const Cell cell = *p;
+        *p = d->cell;
+        d->cell = cell;
+        mark_dirty(c, x, y);
+    }
+}
+
+// このコマンドで初めて書き込むタイルなら、マスごととタイルごとのどちらで記録するかを決める
+// wholeが1ならタイルごとにし、今のタイル (空白ならNULL) を共有して記録する
+// 戻り値はマスごとの記録が要るなら1 (タイルごとに記録済みなら、そのタイルへの書き込みは記録しなくてよい)
+int journal_tile(Canvas* c, const int tx, const int ty, const int whole){
+    TileBlock** bp = block_at(c, tx, ty);
+    if(*bp == NULL){
+        *bp = (TileBlock*)calloc(1, sizeof(TileBlock));
+    }
+    TileBlock* b = *bp;
+    const int i = block_slot(tx, ty);
+    if(b->journaled[i] >> 1 == c->journal_id){
+        return !(b->journaled[i] & 1);
+    }
+    b->journaled[i] = c->journal_id << 1 | (unsigned long long)whole;
+    if(!whole){
+        return 1;
+    }
+    Journal* j = c->journal;
+    if(j->ntiles == j->tiles_cap){
+        j->tiles_cap = (j->tiles_cap == 0) ? 64 : j->tiles_cap*2;
+        j->tiles = (TileDiff*)realloc(j->tiles, j->tiles_cap*sizeof(TileDiff));
+    }
+    const Tile* t = tile_read(c, tx, ty);
+    j->tiles[j->ntiles++] = (TileDiff){.tile = ty*c->tiles_x+tx, .t = (t != &blank_tile) ? tile_share(c, (Tile*)t) : NULL};
+    return 0;
+}
+
+// 記録したタイルとキャンバスのタイルを入れ替える
+// ファイルに対応付けたキャンバスではタイルの位置が決まっているので、中身を入れ替える
+void journal_swap_tile(Canvas* c, TileDiff* d){
+    const int tx = d->tile%c->tiles_x;
+    const int ty = d->tile/c->tiles_x;
+    if(c->header != NULL){
+        Tile* t = tile_write(c, tx, ty);
+        if(d->t == NULL){
+            d->t = alloc_tile();
+            memcpy(d->t->cells, t->cells, sizeof(t->cells));
+            memcpy(t->cells, blank_tile.cells, sizeof(t->cells));
+        }else{
+            Cell tmp[TILE_SIZE*TILE_SIZE];
+            memcpy(tmp, t->cells, sizeof(tmp));
+            memcpy(t->cells, d->t->cells, sizeof(tmp));
+            memcpy(d->t->cells, tmp, sizeof(tmp));
+        }
+    }else{
+        TileBlock** bp = block_at(c, tx, ty);
+        if(*bp == NULL){
+            *bp = (TileBlock*)calloc(1, sizeof(TileBlock));
         }
+        TileBlock* b = *bp;
+        const int i = block_slot(tx, ty);
+        //resetで消えているタイルは空白 (NULL) として入れ替える
+        expire_tile(c, b, tx, ty);
+        Tile* t = b->tiles[i];
+        b->tiles[i] = d->t;
+        d->t = t;
+        set_stamp(c, b, tx, ty, c->epoch);
+    }
+    const int x0 = tx << TILE_SHIFT;
+    const int x1 = min(x0+TILE_MASK, c->width-1);
+    for(int y=ty << TILE_SHIFT ; y<min((ty+1) << TILE_SHIFT, c->height) ; y++){
+        mark_dirty(c, x0, y);
+        mark_dirty(c, x1, y);
+    }
+}
+
+// 記録が持っているタイルを手放す
+void journal_release(Journal* j){
+    for(size_t k=0 ; k<j->ntiles ; k++){
+        tile_release(j->tiles[k].t);
+    }
+    j->ntiles = 0;
+}
+
+
+// Arenaの操作
+void* arena_alloc(Arena* a, size_t size){
+    const size_t align = sizeof(max_align_t);
+    size = (size+align-1)/align*align;
+    Chunk* t = a->top;
+    if(t == NULL || t->used+size > t->size){
+        const size_t chunksize = 64*1024;
+        const size_t n = (size > chunksize) ? size : chunksize;
+        t = (Chunk*)malloc(sizeof(Chunk)+n);
+        *t = (Chunk){.prev = a->top, .size = n, .used = 0};
+        a->top = t;
+    }
+    void* p = t->data+t->used;
+    t->used += size;
+    return p;
+}
+
+ArenaMark arena_mark(Arena* a){
+    return (ArenaMark){.chunk = a->top, .used = (a->top == NULL) ? 0 : a->top->used};
+}
+
+void arena_rewind(Arena* a, ArenaMark m){
+    while(a->top != m.chunk){
+        Chunk* t = a->top;
+        a->top = t->prev;
+        free(t);
+    }
+    if(a->top != NULL){
+        a->top->used = m.used;
+    }
+}
+
+void arena_free(Arena* a){
+    arena_rewind(a, (ArenaMark){.chunk = NULL, .used = 0});
+}
+
+
+void rewind_screen(unsigned int line){
+    //0行を指定するとカーソルが1行上がる端末があるので何もしない
+    if(!quiet && line > 0){
+        printf("\e[%dA",line);
+    }
+}
+
+void clear_command(void){
+    if(!quiet){
+        printf("\e[2K");
+    }
+}
+
+void clear_screen(void){
+    if(!quiet){
+        printf("\e[2J");
+    }
+}
+
+// 実行結果のメッセージ (コマンドの入力行を消して表示する)
+void report(const char* fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(last_message, sizeof(last_message), fmt, ap);
+    va_end(ap);
+    if(!quiet){
         clear_command();
-        printf("undo one operation\n");
-        return COMMAND;
+        fputs(last_message, stdout);
+        message_rows += screen_rows(last_message, strlen(last_message));
     }
-    
-    if(strcmp(s, "reset") == 0){
-        reset_canvas(c);
-        reset_canvascolor(c);
+}
+
+void report_error(const char* fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(last_message, sizeof(last_message), fmt, ap);
+    va_end(ap);
+    if(!quiet){
         clear_command();
-        printf("reset completed\n");
-        return NORMAL;
-    }   
+        fputs(last_message, stderr);
+        message_rows += screen_rows(last_message, strlen(last_message));
+    }
+}
+
+// 端末の幅 (わからなければ80)
+int terminal_width(void){
+    struct winsize ws;
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0){
+        return ws.ws_col;
+    }
+    return 80;
+}
 
-    if(strcmp(s, "quit") == 0){
-        return EXIT;
+// 改行で終わる文字列を出したときに画面で使う行数
+unsigned int screen_rows(const char* s, const size_t len){
+    unsigned int rows = 0;
+    size_t i = 0;
+    while(i < len){
+        size_t n = strcspn(s+i, "\n");
+        if(i+n > len){
+            n = len-i;
+        }
+        rows += line_rows(n);
+        i += n+1;
     }
+    return (rows == 0) ? 1 : rows;
+}
 
-    printf("error: unknown command.\n");
+// n文字の1行を出して改行したときに画面で使う行数 (端末の幅で折り返した分も数える)
+unsigned int line_rows(const size_t n){
+    const size_t width = (size_t)terminal_width();
+    return (n == 0) ? 1 : (unsigned int)((n+width-1)/width);
+}
 
-    return UNKNOWN;
 
+// Historyの操作
+Command* push_back(History* his, const Op* op){
+    clear_redo(his);
+    const ArenaMark m = arena_mark(&his->arena);
+    Command* q = (Command*)arena_alloc(&his->arena, sizeof(Command));
+    *q = (Command){.op = *op, .mark = m, .journal = {0}};
+    link_back(his, q);
+    return q; 
 }
 
-void save_history(const char *filename, History* his){
-    const char* default_history_file = "history.txt";
-    if(filename == NULL){
-        filename = default_history_file;
+// 末尾のコマンドを切り離して返す (freeは呼び出し側)
+Command* pop_back(History* his){
+    Command* p = his->end;
+    if(p==NULL){
+        return NULL;
+    }
+    his->end = p->prev;
+    if(his->end == NULL){
+        his->begin = NULL;
+    }else{
+        his->end->next = NULL;
     }
+    his->count--;
+    p->prev = NULL;
+    return p;
+}
 
-    FILE* fp;
-    if((fp = fopen(filename, "w")) == NULL){
-        fprintf(stderr, "error: cannot open %s.\n", filename);
+void link_back(History* his, Command* p){
+    p->next = NULL;
+    p->prev = his->end;
+    if(his->end == NULL){
+        his->begin = p;
+    }else{
+        his->end->next = p;
+    }
+    his->end = p;
+    his->count++;
+}
+
+// redoスタックの先頭が最も古く確保されたものなので、そこまで巻き戻せばまとめて解放できる
+void clear_redo(History* his){
+    //resetの退避領域はArenaの外にあるので個別に解放する
+    for(Command* q = his->redo ; q != NULL ; q = q->next){
+        free_reset(q->reset);
+        journal_release(&q->journal);
+    }
+    his->redo_count = 0;
+    if(his->redo != NULL){
+        arena_rewind(&his->arena, his->redo->mark);
+        his->redo = NULL;
+    }
+}
+
+// 実行前のpenと色を覚えている値と入れ替える (undo/redo用)
+void swap_state(Canvas* c, Command* q){
+    const char pen = c->pen;
+    const unsigned char color = (unsigned char)c->colorcode;
+    c->pen = q->pen;
+    set_colorcode(c, q->color);
+    q->pen = pen;
+    q->color = color;
+}
+
+void free_history(History* his){
+    clear_history(his, NULL);
+    journal_release(&his->scratch);
+    free(his->scratch.diffs);
+    free(his->scratch.tiles);
+    free(his->points);
+    free(his->tokens);
+    *his = (History){.begin = NULL, .end = NULL, .count = 0, .redo = NULL, .arena = {NULL}, .scratch = {0}};
+}
+
+// 履歴とredoスタックのコマンドを全部捨てる (実行中のコマンドの領域とセッションは残す)
+// 今の世代を作ったresetは履歴のコマンドが持っているので、cがあればc->resetも外す
+void clear_history(History* his, Canvas* c){
+    for(Command* q = his->begin ; q != NULL ; q = q->next){
+        free_reset(q->reset);
+        journal_release(&q->journal);
+    }
+    for(Command* q = his->redo ; q != NULL ; q = q->next){
+        free_reset(q->reset);
+        journal_release(&q->journal);
+    }
+    arena_free(&his->arena);
+    his->begin = NULL;
+    his->end = NULL;
+    his->count = 0;
+    his->redo = NULL;
+    his->redo_count = 0;
+    if(c != NULL){
+        c->reset = NULL;
+    }
+}
+
+// 実行中のコマンドの頂点をn個分入れられる領域を返す
+int* scratch_points(History* his, const size_t n){
+    if(n > his->points_cap){
+        his->points_cap = (n > 2*his->points_cap) ? n : 2*his->points_cap;
+        his->points = (int*)realloc(his->points, his->points_cap*sizeof(int));
+    }
+    return his->points;
+}
+
+// 実行中のコマンドの語をn個分入れられる領域を返す
+Token* scratch_tokens(History* his, const size_t n){
+    if(n > his->tokens_cap){
+        his->tokens_cap = (n > 2*his->tokens_cap) ? n : 2*his->tokens_cap;
+        his->tokens = (Token*)realloc(his->tokens, his->tokens_cap*sizeof(Token));
+    }
+    return his->tokens;
+}
+
+int max(const int a, const int b){
+    return (a>b) ? a:b;
+}
+
+int min(const int a, const int b){
+    return (a<b) ? a:b;
+}
+
+// Bresenhamの直線描画 (整数演算のみ)
+void draw_line(Canvas* c, const int x0, const int y0, const int x1, const int y1){
+    draw_segment(c, x0, y0, x1, y1, 0, 0);
+}
+
+// skip_first/skip_lastが1なら始点/終点を打たない (折れ線で頂点を2度打たないため)
+void draw_segment(Canvas* c, const int x0, const int y0, const int x1, const int y1, const int skip_first, const int skip_last){
+    const int width = c->width;
+    const int height = c->height;
+    char pen = c->pen;
+    const int color = c->colorcode;
+    //全体がキャンバスの外なら何もしない
+    if(max(x0,x1)<0 || min(x0,x1)>=width || max(y0,y1)<0 || min(y0,y1)>=height){
         return;
     }
 
-    Command* p = his->begin;
-    while(p != NULL){
-        fprintf(fp, "%s", p->str);
-        p = p->next;
+    const long long dx = llabs((long long)x1-x0);
+    const long long dy = -llabs((long long)y1-y0);
+    const int sx = (x0<x1) ? 1:-1;
+    const int sy = (y0<y1) ? 1:-1;
+
+    //i歩目の点は長い方の軸にi、短い方の軸にline_minor(i)だけ進んだ位置になる
+    //キャンバスに入っている歩数の範囲[lo,hi]を先に求め、そこだけを描く
+    const int xmajor = (dx >= -dy);
+    const long long major = xmajor ? dx : -dy;
+    const long long minor = xmajor ? -dy : dx;
+    long long lo = skip_first ? 1 : 0;
+    long long hi = skip_last ? major-1 : major;
+    long long mlo;
+    long long mhi;
+    clip_range(xmajor ? x0 : y0, xmajor ? sx : sy, xmajor ? width : height, &lo, &hi);
+    mlo = 0;
+    mhi = minor;
+    clip_range(xmajor ? y0 : x0, xmajor ? sy : sx, xmajor ? height : width, &mlo, &mhi);
+    if(lo > hi || mlo > mhi){
+        return;
+    }
+    //短い方の軸は歩数に対して単調なので二分探索で歩数に直す
+    const long long first = first_step(0, major+1, major, minor, mlo);
+    const long long last = first_step(0, major+1, major, minor, mhi+1)-1;
+    lo = (lo > first) ? lo : first;
+    hi = (hi < last) ? hi : last;
+    if(lo > hi){
+        return;
     }
 
-    fclose(fp);
+    const long long k = line_minor(lo, major, minor);
+    long long err = dx+dy;
+    if(xmajor){
+        err += lo*dy+k*dx;
+    }else{
+        err += k*dy+lo*dx;
+    }
+    int x = (int)(x0+sx*(xmajor ? lo : k));
+    int y = (int)(y0+sy*(xmajor ? k : lo));
+    for(long long i=lo ; i<=hi ; i++){
+        put_cell(c, x, y, pen, color);
+        const long long e2 = 2*err;
+        if(e2 >= dy){
+            err += dy;
+            x += sx;
+        }
+        if(e2 <= dx){
+            err += dx;
+            y += sy;
+        }
+    }
+}
+
+// 頂点を順に結ぶ。closedなら最後の頂点から最初の頂点にも結ぶ
+// 各辺の始点は前の辺の終点と同じなので打たない
+void draw_polyline(Canvas* c, const int* points, const int n, const int closed){
+    if(n <= 0){
+        return;
+    }
+    draw_segment(c, points[0], points[1], points[0], points[1], 0, 0);
+    for(int i=1 ; i<n ; i++){
+        draw_segment(c, points[2*i-2], points[2*i-1], points[2*i], points[2*i+1], 1, 0);
+    }
+    if(closed && n > 2){
+        draw_segment(c, points[2*n-2], points[2*n-1], points[0], points[1], 1, 1);
+    }
+}
+
+// Bresenhamのi歩目で短い方の軸に進んだ数 floor((2*i*minor+major)/(2*major))
+// i*minorは64bitに収まらないことがあるので、iを16bitずつに分けて割る
+long long line_minor(const long long i, const long long major, const long long minor){
+    if(major == 0){
+        return 0;
+    }
+    const unsigned long long a = (unsigned long long)major;
+    const unsigned long long ih = (unsigned long long)i >> 16;
+    const unsigned long long il = (unsigned long long)i & 0xffff;
+    unsigned long long t = ih*(unsigned long long)minor;
+    unsigned long long q = t/a;
+    t = ((t%a) << 16) + il*(unsigned long long)minor;
+    q = (q << 16) + t/a;
+    const unsigned long long r = t%a;
+    return (long long)q + (2*r >= a);
+}
+
+// [lo,hi)の中で、短い方の軸がk以上進んでいる最初の歩数 (なければhi)
+long long first_step(long long lo, long long hi, const long long major, const long long minor, const long long k){
+    while(lo < hi){
+        const long long m = lo+(hi-lo)/2;
+        if(line_minor(m, major, minor) >= k){
+            hi = m;
+        }else{
+            lo = m+1;
+        }
+    }
+    return lo;
+}
+
+// p0からs方向にi歩進んだ座標が[0,size)に入るようにiの範囲[lo,hi]を狭める
+void clip_range(const long long p0, const int s, const int size, long long* lo, long long* hi){
+    if(s > 0){
+        *lo = (*lo > -p0) ? *lo : -p0;
+        *hi = (*hi < size-1-p0) ? *hi : size-1-p0;
+    }else{
+        *lo = (*lo > p0-(size-1)) ? *lo : p0-(size-1);
+        *hi = (*hi < p0) ? *hi : p0;
+    }
 }
 
+void draw_rect(Canvas* c, const int x0, const int y0, const int w0, const int h0){
+    const int width = c->width;
+    const int height = c->height;
+    char pen = c->pen;
+    const int color = c->colorcode;
+    const long long x2 = (long long)x0+w0-1;
+    const long long y2 = (long long)y0+h0-1;
+    //辺のうちキャンバスに入っている範囲だけを描く
+    const int xl = (int)((x0 > 0) ? x0 : 0);
+    const int xr = (int)((x2 < width-1) ? x2 : width-1);
+    const int yt = (int)((y0 > 0) ? y0 : 0);
+    const int yb = (int)((y2 < height-1) ? y2 : height-1);
 
+    //縦
+    for(int y=yt ; y<=yb ; y++){
+        if(x0>=0 && x0<width){
+            put_cell(c, x0, y, pen, color);
+        }
+        if(x2>=0 && x2<width){
+            put_cell(c, (int)x2, y, pen, color);
+        }
+    }
+    //横
+    for(int x=xl ; x<=xr ; x++){
+        if(y0>=0 && y0<height){
+            put_cell(c, x, y0, pen, color);
+        }
+        if(y2>=0 && y2<height){
+            put_cell(c, x, (int)y2, pen, color);
+        }
+    }
+}
 
+// 中点アルゴリズムによる円の描画
+// 1/8円(0<=x<=y)を計算して対称な8点を打つので隙間ができない
+// 8つの1/8円それぞれについてキャンバスに入るxの範囲を先に求め、そこだけを描く
+void draw_circle(Canvas* c, const int x0, const int y0, const int r0){
+    const int width = c->width;
+    const int height = c->height;
+    if(r0 < 0){
+        return;
+    }
+    //外接する正方形がキャンバスの外なら何もしない
+    if((long long)x0+r0<0 || (long long)x0-r0>=width || (long long)y0+r0<0 || (long long)y0-r0>=height){
+        return;
+    }
+    const CircleTable* t = circle_table(r0);
+    const long long xmax = (t != NULL) ? t->xmax : circle_xmax(r0);
+    for(int o=0 ; o<8 ; o++){
+        draw_octant(c, x0, y0, r0, o, xmax, t);
+    }
+}
+
+// 半径rの表を返す (初めての半径なら作る)。大きすぎる半径ではNULL
+const CircleTable* circle_table(const int r){
+    if(r > CIRCLE_CACHE_RADIUS){
+        circle_stats.uncached++;
+        return NULL;
+    }
+    if(circle_cache[r] != NULL){
+        circle_stats.hits++;
+        return circle_cache[r];
+    }
+    circle_stats.misses++;
+    const size_t size = sizeof(CircleTable)+(r+1)*sizeof(int);
+    CircleTable* t = (CircleTable*)malloc(size);
+    circle_stats.bytes += size;
+    t->r = r;
+    int x = 0;
+    int y = r;
+    int d = 1-r;
+    while(x <= y){
+        t->half[x] = y;
+        if(d < 0){
+            d += 2*x+3;
+        }else{
+            d += 2*(x-y)+5;
+            y--;
+        }
+        x++;
+    }
+    t->xmax = x-1;
+    //xmaxより下の行の半幅は、yがその行以上になる最大のx
+    for(x=0 ; x<=t->xmax ; x++){
+        if(t->half[x] > t->xmax){
+            t->half[t->half[x]] = x;
+        }
+    }
+    circle_cache[r] = t;
+    return t;
+}
+
+void free_circle_cache(void){
+    for(int r=0 ; r<=CIRCLE_CACHE_RADIUS ; r++){
+        free(circle_cache[r]);
+        circle_cache[r] = NULL;
+    }
+}
+
+// 中点アルゴリズムでx<=yとなる最後のx
+long long circle_xmax(const long long r){
+    long long lo = 0;
+    long long hi = r;
+    while(lo < hi){
+        const long long m = lo+(hi-lo+1)/2;
+        if(m <= circle_y(r, m)){
+            lo = m;
+        }else{
+            hi = m-1;
+        }
+    }
+    return lo;
+}
+
+// octantのビット0: 横の符号、ビット1: 縦の符号、ビット2: xとyを入れ替える
+void draw_octant(Canvas* c, const int x0, const int y0, const int r, const int octant, const long long xmax, const CircleTable* t){
+    const char pen = c->pen;
+    const int color = c->colorcode;
+    const int sx = (octant & 1) ? -1 : 1;
+    const int sy = (octant & 2) ? -1 : 1;
+    const int swap = (octant & 4) != 0;
+    //xが動く軸とyが動く軸
+    const long long px = swap ? y0 : x0;
+    const long long py = swap ? x0 : y0;
+    const int spx = swap ? sy : sx;
+    const int spy = swap ? sx : sy;
+    const int sizex = swap ? c->height : c->width;
+    const int sizey = swap ? c->width : c->height;
+
+    long long lo = 0;
+    long long hi = xmax;
+    clip_range(px, spx, sizex, &lo, &hi);
+    long long ylo = 0;
+    long long yhi = r;
+    clip_range(py, spy, sizey, &ylo, &yhi);
+    if(lo > hi || ylo > yhi){
+        return;
+    }
+    //yはxについて単調に減るので、yが[ylo,yhi]に入るxの範囲も二分探索で求まる
+    const long long first = first_x_below(0, xmax+1, r, yhi, t);
+    const long long last = first_x_below(0, xmax+1, r, ylo-1, t)-1;
+    lo = (lo > first) ? lo : first;
+    hi = (hi < last) ? hi : last;
+    if(lo > hi){
+        return;
+    }
+
+    if(t != NULL){
+        for(long long x=lo ; x<=hi ; x++){
+            const int u = (int)(px+spx*x);
+            const int v = (int)(py+spy*t->half[x]);
+            if(swap){
+                put_cell(c, v, u, pen, color);
+            }else{
+                put_cell(c, u, v, pen, color);
+            }
+        }
+        return;
+    }
+    long long y = circle_y(r, lo);
+    //中点アルゴリズムの判定値 d = (x+1)^2 + y^2 - y - r^2
+    long long d = (lo+1)*(lo+1)-((long long)r-y)*((long long)r+y)-y;
+    for(long long x=lo ; x<=hi ; x++){
+        const int u = (int)(px+spx*x);
+        const int v = (int)(py+spy*y);
+        if(swap){
+            put_cell(c, v, u, pen, color);
+        }else{
+            put_cell(c, u, v, pen, color);
+        }
+        if(d < 0){
+            d += 2*x+3;
+        }else{
+            d += 2*(x-y)+5;
+            y--;
+        }
+    }
+}
+
+long long isqrt(const long long n){
+    long long lo = 0;
+    long long hi = 3037000499LL;
+    while(lo < hi){
+        const long long m = lo+(hi-lo+1)/2;
+        if(m*m <= n){
+            lo = m;
+        }else{
+            hi = m-1;
+        }
+    }
+    return lo;
+}
+
+// 中点アルゴリズムでxのときに選ばれるy (y^2+y >= r^2-x^2 となる最小のy)
+long long circle_y(const long long r, const long long x){
+    const long long n = (r-x)*(r+x);
+    const long long s = isqrt(n);
+    return (s*s+s >= n) ? s : s+1;
+}
+
+// [lo,hi)の中で、circle_yがy以下になる最初のx (なければhi)
+long long first_x_below(long long lo, long long hi, const long long r, const long long y, const CircleTable* t){
+    while(lo < hi){
+        const long long m = lo+(hi-lo)/2;
+        if(((t != NULL) ? t->half[m] : circle_y(r, m)) <= y){
+            hi = m;
+        }else{
+            lo = m+1;
+        }
+    }
+    return lo;
+}
+
+// 走査線ごとに左右へ塗り広げ、上下の行は塗れる区間ごとに1点だけ積む
+// 塗ったマスはpenになるので、それ自体を訪問済みの印として使う
+void search_for_fill(Canvas* c, int x0, int y0){
+    const int width = c->width;
+    const int height = c->height;
+    const char pen = c->pen;
+    const int color = c->colorcode;
+    if(x0<0 || x0>=width || y0<0 || y0>=height){
+        return;
+    }
+    if(cell_at(c,x0,y0)->ch==pen){
+       return;
+    }
+    size_t cap = 64;
+    size_t n = 0;
+    int (*stack)[2] = malloc(cap*sizeof(*stack));
+    stack[n][0] = x0;
+    stack[n][1] = y0;
+    n++;
+    while(n > 0){
+        n--;
+        const int x = stack[n][0];
+        const int y = stack[n][1];
+        if(cell_at(c,x,y)->ch == pen){
+            continue;
+        }
+        //行はタイルごとに分かれているので、タイルの境目でだけ読む位置を取り直す
+        int xl = x;
+        int xr = x;
+        const Cell* row = tile_row(c,x,y);
+        while(xl > 0){
+            if((xl & TILE_MASK) == 0){
+                row = tile_row(c,xl-1,y);
+            }
+            if(row[(xl-1) & TILE_MASK].ch == pen){
+                break;
+            }
+            xl--;
+        }
+        row = tile_row(c,x,y);
+        while(xr < width-1){
+            if(((xr+1) & TILE_MASK) == 0){
+                row = tile_row(c,xr+1,y);
+            }
+            if(row[(xr+1) & TILE_MASK].ch == pen){
+                break;
+            }
+            xr++;
+        }
+        put_span(c, y, xl, xr, pen, color);
+        for(int dy=-1 ; dy<=1 ; dy+=2){
+            const int ny = y+dy;
+            if(ny<0 || ny>=height){
+                continue;
+            }
+            //塗れるマスが続く区間ごとに先頭を1つ積む
+            int inside = 0;
+            for(int i=xl ; i<=xr ; i++){
+                if(i == xl || (i & TILE_MASK) == 0){
+                    row = tile_row(c,i,ny);
+                }
+                const int open = (row[i & TILE_MASK].ch != pen);
+                if(open && !inside){
+                    if(n == cap){
+                        cap *= 2;
+                        stack = realloc(stack, cap*sizeof(*stack));
+                    }
+                    stack[n][0] = i;
+                    stack[n][1] = ny;
+                    n++;
+                }
+                inside = open;
+            }
+        }
+    }
+    free(stack);
+}
+
+void fill_rect(Canvas* c, const int x0, const int y0, const int w0, const int h0){
+    if(w0 <= 0 || h0 <= 0){
+        return;
+    }
+    const long long x1 = (long long)x0+w0-1;
+    const long long y1 = (long long)y0+h0-1;
+    const int yt = (y0 > 0) ? y0 : 0;
+    const int yb = (int)((y1 < c->height-1) ? y1 : c->height-1);
+    const int xr = (int)((x1 < c->width-1) ? x1 : c->width-1);
+    for(int y=yt ; y<=yb ; y++){
+        put_span(c, y, x0, xr, c->pen, c->colorcode);
+    }
+}
+
+// circleと同じ輪郭の内側を行ごとに塗る
+// 中心からv行目の輪郭の最も外側の点は、v<=xmaxなら(y(v),v)、そうでなければy(x)>=vとなる最大のx
+void fill_circle(Canvas* c, const int x0, const int y0, const int r0){
+    if(r0 < 0){
+        return;
+    }
+    if((long long)x0+r0<0 || (long long)x0-r0>=c->width || (long long)y0+r0<0 || (long long)y0-r0>=c->height){
+        return;
+    }
+    const CircleTable* t = circle_table(r0);
+    const long long xmax = (t != NULL) ? t->xmax : circle_xmax(r0);
+    const long long yt = ((long long)y0-r0 > 0) ? (long long)y0-r0 : 0;
+    const long long yb = ((long long)y0+r0 < c->height-1) ? (long long)y0+r0 : c->height-1;
+    for(long long y=yt ; y<=yb ; y++){
+        const long long v = llabs(y-y0);
+        long long h;
+        if(t != NULL){
+            h = t->half[v];
+        }else{
+            h = (v <= xmax) ? circle_y(r0, v) : first_x_below(0, xmax+1, r0, v-1, NULL)-1;
+        }
+        const long long xl = (long long)x0-h;
+        const long long xr = (long long)x0+h;
+        if(xr < 0 || xl >= c->width){
+            continue;
+        }
+        put_span(c, (int)y, (int)((xl > 0) ? xl : 0), (int)((xr < c->width) ? xr : c->width-1), c->pen, c->colorcode);
+    }
+}
+
+int compare_edge(const void* a, const void* b){
+    const double ya = ((const Edge*)a)->ytop;
+    const double yb = ((const Edge*)b)->ytop;
+    return (ya > yb) - (ya < yb);
+}
+
+long long floor_ll(const double x){
+    long long i = (long long)x;
+    if(i > x){
+        i--;
+    }
+    return i;
+}
+
+// 頂点(points[2i],points[2i+1])を順に結んだ多角形を塗る
+// 座標はマスの中心を指すので、各行の中心を通る水平線と辺の交点を活性辺表で求め、
+// 偶奇規則で内側を塗ったあと輪郭を描く
+void fill_polygon(Canvas* c, const int* points, const int n){
+    if(n < 3){
+        return;
+    }
+    Edge* edges = (Edge*)malloc(n*sizeof(Edge));
+    Edge** active = (Edge**)malloc(n*sizeof(Edge*));
+    double* xs = (double*)malloc(n*sizeof(double));
+    int m = 0;
+    double ymin = points[1];
+    double ymax = points[1];
+    for(int i=0 ; i<n ; i++){
+        const double xa = points[2*i];
+        const double ya = points[2*i+1];
+        const double xb = points[2*((i+1)%n)];
+        const double yb = points[2*((i+1)%n)+1];
+        ymin = (ya < ymin) ? ya : ymin;
+        ymax = (ya > ymax) ? ya : ymax;
+        if(ya == yb){
+            continue; //水平な辺は交点を持たない
+        }
+        const double slope = (xb-xa)/(yb-ya);
+        edges[m++] = (ya < yb) ? (Edge){.ytop = ya, .ybottom = yb, .x = xa, .slope = slope}
+                               : (Edge){.ytop = yb, .ybottom = ya, .x = xb, .slope = slope};
+    }
+    qsort(edges, m, sizeof(Edge), compare_edge);
+
+    //キャンバスに入っている行だけを走査する
+    const int y0 = (ymin > 0) ? (int)ymin : 0;
+    const int y1 = (ymax < c->height-1) ? (int)ymax : c->height-1;
+    int next = 0;
+    int nactive = 0;
+    for(int y=y0 ; y<=y1 ; y++){
+        const double yc = y;
+        while(next < m && edges[next].ytop <= yc){
+            active[nactive++] = &edges[next++];
+        }
+        int k = 0;
+        int nx = 0;
+        for(int i=0 ; i<nactive ; i++){
+            Edge* e = active[i];
+            if(e->ybottom <= yc){
+                continue; //この行より上で終わった辺は外す
+            }
+            active[k++] = e;
+            //xsは挿入ソートで並べておく
+            double x = e->x+(yc-e->ytop)*e->slope;
+            int j = nx++;
+            while(j > 0 && xs[j-1] > x){
+                xs[j] = xs[j-1];
+                j--;
+            }
+            xs[j] = x;
+        }
+        nactive = k;
+        //中心が[xs[2i], xs[2i+1]]に入るマスを塗る
+        for(int i=0 ; i+1<nx ; i+=2){
+            const long long xl = -floor_ll(-xs[i]);
+            const long long xr = floor_ll(xs[i+1]);
+            if(xr < 0 || xl >= c->width){
+                continue;
+            }
+            put_span(c, y, (int)((xl > 0) ? xl : 0), (int)((xr < c->width) ? xr : c->width-1), c->pen, c->colorcode);
+        }
+    }
+    free(edges);
+    free(active);
+    free(xs);
+
+    draw_polyline(c, points, n, 1);
+}
+
+int color_getter(Canvas* c){
+    char* co = c->color;
+    if(strcmp(co,"red")==0){
+        return 31;
+    }else if(strcmp(co, "green")==0){
+        return 32;
+    }else if(strcmp(co, "yellow")==0){
+        return 33;
+    }else if(strcmp(co, "blue")==0){
+        return 34;
+    }else if(strcmp(co, "magenta")==0){
+        return 35;
+    }else if(strcmp(co, "cyan")==0){
+        return 36;
+    }
+    return 0;
+}
+
+const char* color_name(const int code){
+    switch(code){
+        case 31:
+            return "red";
+        case 32:
+            return "green";
+        case 33:
+            return "yellow";
+        case 34:
+            return "blue";
+        case 35:
+            return "magenta";
+        case 36:
+            return "cyan";
+    }
+    return "default";
+}
+
+// colorを変更し、描画で使う色の値をここで一度だけ解決しておく
+// 色の値として使えるか (0か31-36)。ファイルから読んだ値を確かめるのに使う
+int valid_color(const int code){
+    return code == 0 || (code >= 31 && code <= 36);
+}
+
+// penにできる文字か (コマンドの1語になる文字。区切りの空白や改行、'\0'は入力できない)
+int valid_pen(const int ch){
+    return ch != '\0' && ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r';
+}
+
+void set_color(Canvas* c, const char* color){
+    strcpy(c->color, color);
+    c->colorcode = color_getter(c);
+}
+
+void set_colorcode(Canvas* c, const int code){
+    strcpy(c->color, color_name(code));
+    c->colorcode = code;
+}
+
+// 解釈済みのコマンドを実行する (文字列の解析を通さない)
+void apply_op(Canvas* c, const Op* op){
+    const int* a = op->arg;
+    switch(op->code){
+        case OP_LINE:
+            draw_line(c,a[0],a[1],a[2],a[3]);
+            break;
+        case OP_RECT:
+            draw_rect(c,a[0],a[1],a[2],a[3]);
+            break;
+        case OP_CIRCLE:
+            draw_circle(c,a[0],a[1],a[2]);
+            break;
+        case OP_FILL:
+            search_for_fill(c,a[0],a[1]);
+            break;
+        case OP_ERASE:
+            if(a[0]>=0 && a[0]<c->width && a[1]>=0 && a[1]<c->height){
+                put_cell(c, a[0], a[1], ' ', 0);
+            }
+            break;
+        case OP_CHPEN:
+            c->pen = op->ch;
+            break;
+        case OP_CHCOLOR:
+            set_colorcode(c, a[0]);
+            break;
+        case OP_RESET:
+            reset_tiles(c);
+            break;
+        case OP_FILLRECT:
+            fill_rect(c,a[0],a[1],a[2],a[3]);
+            break;
+        case OP_FILLCIRCLE:
+            fill_circle(c,a[0],a[1],a[2]);
+            break;
+        case OP_FILLPOLY:
+            fill_polygon(c,op->points,op->npoints);
+            break;
+        case OP_POLYLINE:
+        case OP_POLYGON:
+            draw_polyline(c,op->points,op->npoints,op->code == OP_POLYGON);
+            break;
+        case OP_LOADCANVAS:
+            //履歴を読み込み直したときにファイルがなくなっていれば、全体を消すだけにする
+            if(!load_canvas_rle(c, op->name, NULL)){
+                reset_tiles(c);
+            }
+            break;
+    }
+}
+
+// コマンドを入力と同じ形式の1行 (改行付き) で書き出す
+void print_op(FILE* fp, const Op* op){
+    const int* a = op->arg;
+    switch(op->code){
+        case OP_LINE:
+            fprintf(fp, "line %d %d %d %d\n", a[0], a[1], a[2], a[3]);
+            break;
+        case OP_RECT:
+            fprintf(fp, "rect %d %d %d %d\n", a[0], a[1], a[2], a[3]);
+            break;
+        case OP_CIRCLE:
+            fprintf(fp, "circle %d %d %d\n", a[0], a[1], a[2]);
+            break;
+        case OP_FILL:
+            fprintf(fp, "fill %d %d\n", a[0], a[1]);
+            break;
+        case OP_ERASE:
+            fprintf(fp, "erase %d %d\n", a[0], a[1]);
+            break;
+        case OP_CHPEN:
+            fprintf(fp, "chpen %c\n", op->ch);
+            break;
+        case OP_CHCOLOR:
+            fprintf(fp, "chcolor %s\n", color_name(a[0]));
+            break;
+        case OP_RESET:
+            fprintf(fp, "reset\n");
+            break;
+        case OP_FILLRECT:
+            fprintf(fp, "fillrect %d %d %d %d\n", a[0], a[1], a[2], a[3]);
+            break;
+        case OP_FILLCIRCLE:
+            fprintf(fp, "fillcircle %d %d %d\n", a[0], a[1], a[2]);
+            break;
+        case OP_FILLPOLY:
+        case OP_POLYLINE:
+        case OP_POLYGON:
+            fprintf(fp, (op->code == OP_FILLPOLY) ? "fillpoly" : (op->code == OP_POLYLINE) ? "polyline" : "polygon");
+            for(int i=0 ; i<2*op->npoints ; i++){
+                fprintf(fp, " %d", op->points[i]);
+            }
+            fprintf(fp, "\n");
+            break;
+        case OP_LOADCANVAS:
+            fprintf(fp, "loadcanvas %s\n", op->name);
+            break;
+    }
+}
+
+// 入力行を空白で区切ってhis->tokensに入れ、語の数を返す。文字列はコピーせず入力中の位置と長さだけを持つ
+// his->tokensは語の数に合わせて伸ばすので、語の数はintに収まる限りいくつでもよい (収まらなければ-1)
+int tokenize(const char* line, History* his){
+    int n = 0;
+    const char* p = line;
+    while(*p != '\0'){
+        while(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'){
+            p++;
+        }
+        if(*p == '\0'){
+            break;
+        }
+        const char* s = p;
+        while(*p != '\0' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r'){
+            p++;
+        }
+        if(n == INT_MAX){
+            return -1;
+        }
+        Token* tokens = scratch_tokens(his, (size_t)n+1);
+        tokens[n++] = (Token){.s = s, .len = (int)(p-s)};
+    }
+    return n;
+}
+
+// 10進の整数として読む。範囲外の値はintの範囲に丸める
+int parse_int(const Token* t, int* value){
+    const char* p = t->s;
+    const char* end = t->s+t->len;
+    int neg = 0;
+    if(p < end && (*p == '-' || *p == '+')){
+        neg = (*p == '-');
+        p++;
+    }
+    if(p == end){
+        return 0;
+    }
+    long long v = 0;
+    for( ; p<end ; p++){
+        if(*p < '0' || *p > '9'){
+            return 0;
+        }
+        if(v <= INT_MAX){
+            v = v*10+(*p-'0');
+        }
+    }
+    if(neg){
+        v = -v;
+    }
+    *value = (v > INT_MAX) ? INT_MAX : (v < INT_MIN) ? INT_MIN : (int)v;
+    return 1;
+}
+
+// トークンをNUL終端の文字列としてbufにコピーする (長すぎる分は切り捨て)
+const char* token_str(const Token* t, char* buf, const size_t size){
+    const size_t n = ((size_t)t->len < size-1) ? (size_t)t->len : size-1;
+    memcpy(buf, t->s, n);
+    buf[n] = '\0';
+    return buf;
+}
+
+// 名前の長さと最初と最後の文字から表の位置を決める
+int command_hash(const char* name, const int len){
+    return (len*5+(unsigned char)name[0]*25+(unsigned char)name[len-1]) & (COMMAND_HASH_SIZE-1);
+}
+
+// 表は初めて呼ばれたときに作る。ハッシュ値が重なったら次の位置を使う
+const CommandDesc* find_command(const Token* verb){
+    if(!command_table_ready){
+        for(int i=0 ; commands[i].name != NULL ; i++){
+            int h = command_hash(commands[i].name, commands[i].len);
+            while(command_table[h] != 0){
+                h = (h+1) & (COMMAND_HASH_SIZE-1);
+            }
+            command_table[h] = (unsigned char)(i+1);
+        }
+        command_table_ready = 1;
+    }
+    for(int h = command_hash(verb->s, verb->len) ; command_table[h] != 0 ; h = (h+1) & (COMMAND_HASH_SIZE-1)){
+        const CommandDesc* d = &commands[command_table[h]-1];
+        if(d->len == verb->len && memcmp(d->name, verb->s, verb->len) == 0){
+            return d;
+        }
+    }
+    return NULL;
+}
+
+Result interpret_command(const char* command, History* his, Canvas* c, Op* op){
+    const int n = tokenize(command, his);
+    if(n < 0){
+        report("error: too many arguments.\n");
+        return ERROR;
+    }
+    const Token* tokens = his->tokens;
+    const CommandDesc* d = (n > 0) ? find_command(&tokens[0]) : NULL;
+    if(d == NULL){
+        report("error: unknown command.\n");
+        return UNKNOWN;
+    }
+
+    int p[MAX_ARGS];
+    if(n-1 < d->nargs){
+        report("the number of point is not enough.\n");
+        return ERROR;
+    }
+    for(int i=0 ; i<d->nargs ; i++){
+        if(!parse_int(&tokens[i+1], &p[i])){
+            report("Non-int value is included.\n");
+            return ERROR;
+        }
+    }
+    return d->handler(c, his, p, tokens+1, n-1, op);
+}
+
+Result cmd_line(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    *op = (Op){.code = OP_LINE, .arg = {p[0],p[1],p[2],p[3]}};
+    apply_op(c, op);
+    report("1 line drawn\n");
+    return NORMAL;
+}
+
+Result cmd_rect(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    *op = (Op){.code = OP_RECT, .arg = {p[0],p[1],p[2],p[3]}};
+    apply_op(c, op);
+    report("1 rectangle drawn\n");
+    return NORMAL;
+}
+
+Result cmd_circle(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    *op = (Op){.code = OP_CIRCLE, .arg = {p[0],p[1],p[2]}};
+    apply_op(c, op);
+    report("1 circle drawn\n");
+    return NORMAL;
+}
+
+Result cmd_fill(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    *op = (Op){.code = OP_FILL, .arg = {p[0],p[1]}};
+    apply_op(c, op);
+    report("fill (%d,%d)\n",p[0],p[1]);
+    return NORMAL;
+}
+
+Result cmd_erase(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    if(p[0]<0 || p[0]>=c->width || p[1]<0 || p[1]>=c->height){
+        report("out of range\n");
+        return ERROR;
+    }
+    *op = (Op){.code = OP_ERASE, .arg = {p[0],p[1]}};
+    apply_op(c, op);
+    report("erase (%d,%d)\n",p[0],p[1]);
+    return NORMAL;
+}
+
+Result cmd_chpen(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    if(argc < 1){
+        report("not include new pen\n");
+        return ERROR;
+    }
+    if(args[0].len != 1){
+        report_error("error: %.*s is not \"one\" character.\n",args[0].len,args[0].s);
+        return ERROR;
+    }
+    char past = c->pen;
+    *op = (Op){.code = OP_CHPEN, .ch = args[0].s[0]};
+    apply_op(c, op);
+    report("pen changed: %c -> %c\n",past, c->pen);
+    return NORMAL;
+}
+
+Result cmd_chcolor(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    if(argc < 1){
+        report("fill color name\n");
+        return ERROR;
+    }
+    char s[50];
+    token_str(&args[0], s, sizeof(s));
+    set_color(c,s);
+    *op = (Op){.code = OP_CHCOLOR, .arg = {c->colorcode}};
+    if(c->colorcode == 0){
+        report("color not registered: %s\n",s);
+    }else{
+        report("color changed: to %s\n",s);
+    }
+    return NORMAL;
+}
+
+Result cmd_save(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    char s[FILENAME_MAX];
+    const char* filename = (argc < 1) ? NULL : token_str(&args[0], s, sizeof(s));
+    save_history(filename, his);
+    report("saved as \"%s\"\n", (filename==NULL) ? "history.txt":filename);
+    return COMMAND;
+}
+
+Result cmd_savebin(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    char s[FILENAME_MAX];
+    const char* filename = (argc < 1) ? "history.bin" : token_str(&args[0], s, sizeof(s));
+    if(save_history_binary(filename, his)){
+        report("saved as \"%s\"\n", filename);
+    }
+    return COMMAND;
+}
+
+// 先頭がHISTORY_MAGICならバイナリ形式、そうでなければテキストとして読む
+Result cmd_load(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    char s[FILENAME_MAX];
+    const char* filename = (argc < 1) ? "history.txt" : token_str(&args[0], s, sizeof(s));
+
+    FILE* fp;
+    if((fp = fopen(filename, "r")) == NULL){
+        report_error("error: cannot open %s.\n", filename);
+        return ERROR;
+    } 
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    LoadStats st = {.applied = 0, .rejected = 0, .first_line = 0};
+    //1コマンドごとのメッセージは出さず、最後にまとめて報告する
+    const int outer = quiet;
+    quiet = 1;
+    Result r;
+    char magic[4];
+    if(fread(magic, 1, 4, fp) == 4 && memcmp(magic, HISTORY_MAGIC, 4) == 0){
+        fclose(fp);
+        r = load_history_binary(filename, his, c, &st);
+    }else{
+        rewind(fp);
+        r = load_history_text(fp, his, c, &st);
+        fclose(fp);
+    }
+    quiet = outer;
+    //画面の書き直しは読み込み後のprint_dirty 1回だけ
+    mark_all_dirty(c);
+    const double t = elapsed_since(&t0);
+    if(st.rejected == 0){
+        report("%s is loaded: %lu applied in %.3f s.\n", filename, st.applied, t);
+    }else{
+        char where[32] = "";
+        if(st.first_line > 0){
+            snprintf(where, sizeof(where), "line %lu: ", st.first_line);
+        }
+        report_error("%s is loaded: %lu applied, %lu rejected in %.3f s (%s%s", filename, st.applied, st.rejected, t, where, st.first_error);
+    }
+    return r;
+}
+
+// 最初のエラーだけ覚えておく
+void load_error(LoadStats* st, const unsigned long line){
+    if(st->rejected++ == 0){
+        st->first_line = line;
+        //last_messageは改行で終わるので閉じ括弧をその前に入れる
+        const size_t len = strcspn(last_message, "\n");
+        snprintf(st->first_error, sizeof(st->first_error), "%.*s)\n", (int)len, last_message);
+    }
+}
+
+Result load_history_text(FILE* fp, History* his, Canvas* c, LoadStats* st){
+    char* buf = NULL;
+    size_t bufsize = 0;
+    unsigned long line = 0;
+    while(getline(&buf, &bufsize, fp) >= 0){
+        line++;
+        const Result r = record_command(buf, his,c);
+        if(r == EXIT){
+            break;
+        }
+        if(r == ERROR || r == UNKNOWN){
+            load_error(st, line);
+        }else{
+            st->applied++;
+        }
+    }
+    free(buf);
+    return (st->rejected == 0) ? COMMAND : ERROR;
+}
+
+double elapsed_since(const struct timespec* t0){
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec-t0->tv_sec) + (t1.tv_nsec-t0->tv_nsec)*1e-9;
+}
+
+Result cmd_undo(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    Command* q = pop_back(his);
+    if(q != NULL){
+        journal_apply(c, &q->journal, 1);
+        if(q->reset != NULL){
+            undo_reset(c, q->reset);
+        }
+        swap_state(c, q);
+        q->next = his->redo;
+        his->redo = q;
+        his->redo_count++;
+        session_log_undo(his, c, q, LOG_UNDO);
+    }
+    report("undo one operation\n");
+    return COMMAND;
+}
+
+Result cmd_redo(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    Command* q = his->redo;
+    if(q == NULL){
+        report("nothing to redo\n");
+        return COMMAND;
+    }
+    his->redo = q->next;
+    his->redo_count--;
+    //loadcanvasはresetの後に書き込んでいるので、世代を進めてから書き込み直す
+    if(q->reset != NULL){
+        redo_reset(c, q->reset);
+    }
+    journal_apply(c, &q->journal, 0);
+    swap_state(c, q);
+    //redoスタックを壊さないよう直接末尾につなぐ
+    link_back(his, q);
+    session_log_undo(his, c, q, LOG_REDO);
+    report("redo one operation\n");
+    return COMMAND;
+}
+
+Result cmd_reset(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    *op = (Op){.code = OP_RESET};
+    apply_op(c, op);
+    report("reset completed\n");
+    return NORMAL;
+}
+
+Result cmd_quit(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    return EXIT;
+}
+
+Result cmd_fillrect(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    *op = (Op){.code = OP_FILLRECT, .arg = {p[0],p[1],p[2],p[3]}};
+    apply_op(c, op);
+    report("1 rectangle filled\n");
+    return NORMAL;
+}
+
+Result cmd_fillcircle(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    *op = (Op){.code = OP_FILLCIRCLE, .arg = {p[0],p[1],p[2]}};
+    apply_op(c, op);
+    report("1 circle filled\n");
+    return NORMAL;
+}
+
+// fillpoly x0 y0 x1 y1 x2 y2 ... (3点以上)
+Result cmd_fillpoly(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    const Result r = parse_points(his, args, argc, 3, OP_FILLPOLY, op);
+    if(r != NORMAL){
+        return r;
+    }
+    apply_op(c, op);
+    report("1 polygon filled\n");
+    return NORMAL;
+}
+
+// polyline x0 y0 x1 y1 ... (2点以上)
+Result cmd_polyline(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    const Result r = parse_points(his, args, argc, 2, OP_POLYLINE, op);
+    if(r != NORMAL){
+        return r;
+    }
+    apply_op(c, op);
+    report("%d lines drawn\n", op->npoints-1);
+    return NORMAL;
+}
+
+// polygon x0 y0 x1 y1 x2 y2 ... (3点以上、最後の頂点と最初の頂点も結ぶ)
+Result cmd_polygon(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    const Result r = parse_points(his, args, argc, 3, OP_POLYGON, op);
+    if(r != NORMAL){
+        return r;
+    }
+    apply_op(c, op);
+    report("1 polygon drawn\n");
+    return NORMAL;
+}
+
+Result cmd_stats(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    const unsigned long total = circle_stats.hits+circle_stats.misses+circle_stats.uncached;
+    //確保したブロックの中のNULLでないタイルだけが確保済み
+    long long allocated = 0;
+    for(size_t i=0 ; i<(size_t)c->blocks_x*c->blocks_y ; i++){
+        if(c->blocks[i] == NULL){
+            continue;
+        }
+        for(int k=0 ; k<BLOCK_SIZE*BLOCK_SIZE ; k++){
+            allocated += (c->blocks[i]->tiles[k] != NULL);
+        }
+    }
+    //80桁の端末で折り返さないよう2行に分ける
+    report("circle table: %lu hits, %lu built, %lu uncached (%.1f%% hit, %zu bytes)\n"
+           "tiles: %lld/%lld allocated\n",
+           circle_stats.hits, circle_stats.misses, circle_stats.uncached,
+           (total > 0) ? 100.0*circle_stats.hits/total : 0.0, circle_stats.bytes,
+           allocated, (long long)c->tiles_x*c->tiles_y);
+    //バッチ処理ではreportが何も出さないので、キャンバスと同じ標準出力に出す
+    if(batch_output){
+        fputs(last_message, stdout);
+    }
+    return COMMAND;
+}
+
+Result cmd_savecanvas(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    char s[FILENAME_MAX];
+    const char* filename = (argc < 1) ? "canvas.rle" : token_str(&args[0], s, sizeof(s));
+    if(save_canvas_rle(filename, c, 0)){
+        report("canvas saved as \"%s\"\n", filename);
+    }
+    return COMMAND;
+}
+
+// 保存したキャンバスに置き換える。resetしてから空白でない部分だけを書くので、undoで元に戻せる
+Result cmd_loadcanvas(Canvas* c, History* his, const int* p, const Token* args, const int argc, Op* op){
+    const char* filename = (argc < 1) ? "canvas.rle" : token_str(&args[0], his->name, sizeof(his->name));
+    if(filename != his->name){
+        strcpy(his->name, filename);
+    }
+    if(!load_canvas_rle(c, his->name, NULL)){
+        return ERROR;
+    }
+    *op = (Op){.code = OP_LOADCANVAS, .name = his->name};
+    report("canvas \"%s\" loaded\n", his->name);
+    return NORMAL;
+}
+
+// 引数を頂点の座標の列として読み、opに入れる
+Result parse_points(History* his, const Token* args, const int argc, const int minpoints, const int code, Op* op){
+    if(argc < 2*minpoints || argc%2 != 0){
+        report("the number of point is not enough.\n");
+        return ERROR;
+    }
+    int* points = scratch_points(his, argc);
+    for(int i=0 ; i<argc ; i++){
+        if(!parse_int(&args[i], &points[i])){
+            report("Non-int value is included.\n");
+            return ERROR;
+        }
+    }
+    *op = (Op){.code = (unsigned char)code, .npoints = argc/2, .points = points};
+    return NORMAL;
+}
+
+// コマンドを実行し、履歴に残るものはキャンバスの変更記録と一緒に保存する
+Result record_command(const char* command, History* his, Canvas* c){
+    Journal* outer = c->journal;
+    Journal* j = &his->scratch;
+    const char pen = c->pen;
+    const unsigned char color = (unsigned char)c->colorcode;
+    Op op;
+
+    j->len = 0;
+    journal_release(j);
+    c->journal = j;
+    c->journal_id++;
+    const Result r = interpret_command(command, his, c, &op);
+    c->journal = outer;
+    if(r == NORMAL){
+        store_command(his, c, &op, pen, color);
+    }
+    //undoなどでpenや色、世代が変わることもあるので、どのコマンドの後でもファイルに残す
+    store_header(c);
+    return r;
+}
+
+// 解釈済みのコマンドを実行して履歴に積む
+void record_op(const Op* op, History* his, Canvas* c){
+    Journal* outer = c->journal;
+    Journal* j = &his->scratch;
+    const char pen = c->pen;
+    const unsigned char color = (unsigned char)c->colorcode;
+
+    j->len = 0;
+    journal_release(j);
+    c->journal = j;
+    c->journal_id++;
+    apply_op(c, op);
+    c->journal = outer;
+    store_command(his, c, op, pen, color);
+}
+
+// his->scratchに記録された変更を実行前のpen, 色と一緒に履歴に積む
+Command* store_command(History* his, Canvas* c, const Op* op, const char pen, const unsigned char color){
+    Journal* j = &his->scratch;
+    Command* q = push_back(his, op);
+    q->journal.diffs = (Diff*)arena_alloc(&his->arena, j->len*sizeof(Diff));
+    if(j->len > 0){
+        memcpy(q->journal.diffs, j->diffs, j->len*sizeof(Diff));
+    }
+    q->journal.len = j->len;
+    q->journal.cap = j->len;
+    //タイルの参照は履歴に移す
+    q->journal.tiles = (TileDiff*)arena_alloc(&his->arena, j->ntiles*sizeof(TileDiff));
+    if(j->ntiles > 0){
+        memcpy(q->journal.tiles, j->tiles, j->ntiles*sizeof(TileDiff));
+    }
+    q->journal.ntiles = j->ntiles;
+    q->journal.tiles_cap = j->ntiles;
+    j->ntiles = 0;
+    if(op->npoints > 0){
+        int* points = (int*)arena_alloc(&his->arena, 2*op->npoints*sizeof(int));
+        memcpy(points, op->points, 2*op->npoints*sizeof(int));
+        q->op.points = points;
+    }
+    if(op->name != NULL){
+        char* name = (char*)arena_alloc(&his->arena, strlen(op->name)+1);
+        strcpy(name, op->name);
+        q->op.name = name;
+    }
+    q->pen = pen;
+    q->color = color;
+    //reset, loadcanvasは実行時にresetを1つ作っている
+    if(op->code == OP_RESET || op->code == OP_LOADCANVAS){
+        q->reset = c->reset;
+    }
+    session_log_op(his, op);
+    return q;
+}
+
+void save_history(const char *filename, History* his){
+    const char* default_history_file = "history.txt";
+    if(filename == NULL){
+        filename = default_history_file;
+    }
+
+    FILE* fp;
+    if((fp = fopen(filename, "w")) == NULL){
+        report_error("error: cannot open %s.\n", filename);
+        return;
+    }
+
+    //テキストは保存するときにだけ作る
+    Command* p = his->begin;
+    while(p != NULL){
+        print_op(fp, &p->op);
+        p = p->next;
+    }
+
+    fclose(fp);
+}
+
+int op_nargs(const int code){
+    switch(code){
+        case OP_LINE:
+        case OP_RECT:
+        case OP_FILLRECT:
+            return 4;
+        case OP_CIRCLE:
+        case OP_FILLCIRCLE:
+            return 3;
+        case OP_FILL:
+        case OP_ERASE:
+            return 2;
+        case OP_CHCOLOR:
+            return 1;
+    }
+    return 0;
+}
+
+// 符号付きの値をzigzag符号化して7bitずつ書く
+void put_varint(FILE* fp, const int v){
+    unsigned int u = ((unsigned int)v << 1) ^ (unsigned int)(v >> 31);
+    while(u >= 0x80){
+        fputc((int)(u & 0x7f) | 0x80, fp);
+        u >>= 7;
+    }
+    fputc((int)u, fp);
+}
+
+int get_varint(const unsigned char** p, const unsigned char* end, int* v){
+    unsigned int u = 0;
+    for(int shift=0 ; shift<35 ; shift+=7){
+        if(*p == end){
+            return 0;
+        }
+        const unsigned char b = *(*p)++;
+        u |= (unsigned int)(b & 0x7f) << shift;
+        if((b & 0x80) == 0){
+            *v = (int)(u >> 1) ^ -(int)(u & 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int save_history_binary(const char* filename, History* his){
+    FILE* fp;
+    if((fp = fopen(filename, "wb")) == NULL){
+        report_error("error: cannot open %s.\n", filename);
+        return 0;
+    }
+    unsigned char header[HISTORY_HEADER_SIZE] = {0};
+    memcpy(header, HISTORY_MAGIC, 4);
+    header[4] = HISTORY_VERSION;
+    for(int i=0 ; i<8 ; i++){
+        header[8+i] = (unsigned char)((unsigned long long)his->count >> (8*i));
+    }
+    fwrite(header, 1, sizeof(header), fp);
+
+    for(Command* p = his->begin ; p != NULL ; p = p->next){
+        put_op(fp, &p->op);
+    }
+    fclose(fp);
+    return 1;
+}
+
+// 1コマンドをopcode 1バイト + 引数で書く
+void put_op(FILE* fp, const Op* op){
+    fputc(op->code, fp);
+    if(op->code == OP_CHPEN){
+        fputc((unsigned char)op->ch, fp);
+    }
+    const int n = op_nargs(op->code);
+    for(int i=0 ; i<n ; i++){
+        put_varint(fp, op->arg[i]);
+    }
+    //頂点を持つコマンドは頂点の数の後に座標を並べる
+    if(op->npoints > 0){
+        put_varint(fp, op->npoints);
+        for(int i=0 ; i<2*op->npoints ; i++){
+            put_varint(fp, op->points[i]);
+        }
+    }
+    //ファイル名は長さの後にそのまま並べる
+    if(op->name != NULL){
+        const int len = (int)strlen(op->name);
+        put_varint(fp, len);
+        fwrite(op->name, 1, len, fp);
+    }
+}
+
+// put_opで書いた1コマンドを読み、*pを次の位置に進める。壊れていれば0を返す
+// 頂点とファイル名はhisの作業領域に置く
+int get_op(const unsigned char** p, const unsigned char* end, History* his, Op* op){
+    const unsigned char* q = *p;
+    if(q == end || *q >= OP_COUNT){
+        return 0;
+    }
+    *op = (Op){.code = *q++};
+    if(op->code == OP_CHPEN){
+        if(q == end){
+            return 0;
+        }
+        op->ch = (char)*q++;
+        if(!valid_pen(op->ch)){
+            return 0;
+        }
+    }
+    const int nargs = op_nargs(op->code);
+    for(int i=0 ; i<nargs ; i++){
+        if(!get_varint(&q, end, &op->arg[i])){
+            return 0;
+        }
+    }
+    if(op->code == OP_CHCOLOR && !valid_color(op->arg[0])){
+        return 0;
+    }
+    if(op->code == OP_FILLPOLY || op->code == OP_POLYLINE || op->code == OP_POLYGON){
+        //座標は1つ1バイト以上なので、残りの長さを超える頂点の数は壊れている
+        const int minpoints = (op->code == OP_POLYLINE) ? 2 : 3;
+        if(!get_varint(&q, end, &op->npoints) || op->npoints < minpoints || op->npoints > (end-q)/2){
+            return 0;
+        }
+        int* points = scratch_points(his, 2*op->npoints);
+        for(int i=0 ; i<2*op->npoints ; i++){
+            if(!get_varint(&q, end, &points[i])){
+                return 0;
+            }
+        }
+        op->points = points;
+    }
+    if(op->code == OP_LOADCANVAS){
+        int len;
+        if(!get_varint(&q, end, &len) || len <= 0 || len >= FILENAME_MAX || len > end-q){
+            return 0;
+        }
+        memcpy(his->name, q, len);
+        his->name[len] = '\0';
+        q += len;
+        op->name = his->name;
+    }
+    *p = q;
+    return 1;
+}
+
+// ファイル全体をmmapし、先頭から順に解釈しながら実行する
+Result load_history_binary(const char* filename, History* his, Canvas* c, LoadStats* st){
+    const int fd = open(filename, O_RDONLY);
+    struct stat sb;
+    if(fd < 0 || fstat(fd, &sb) < 0 || sb.st_size < HISTORY_HEADER_SIZE){
+        if(fd >= 0){
+            close(fd);
+        }
+        report_error("error: cannot read %s.\n", filename);
+        load_error(st, 0);
+        return ERROR;
+    }
+    const size_t size = (size_t)sb.st_size;
+    unsigned char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED){
+        report_error("error: cannot read %s.\n", filename);
+        load_error(st, 0);
+        return ERROR;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    if(data[4] != HISTORY_VERSION){
+        report_error("error: %s: unsupported version %d.\n", filename, data[4]);
+        munmap(data, size);
+        load_error(st, 0);
+        return ERROR;
+    }
+    unsigned long long count = 0;
+    for(int i=0 ; i<8 ; i++){
+        count |= (unsigned long long)data[8+i] << (8*i);
+    }
+
+    const unsigned char* p = data+HISTORY_HEADER_SIZE;
+    const unsigned char* end = data+size;
+    unsigned long long n = 0;
+    int broken = 0;
+    for( ; n<count ; n++){
+        Op op;
+        if(!get_op(&p, end, his, &op)){
+            broken = 1;
+            break;
+        }
+        record_op(&op, his, c);
+        st->applied++;
+    }
+    munmap(data, size);
+
+    if(broken){
+        report_error("error: broken record after %llu commands.\n", n);
+        //バイナリ形式では行番号の代わりに何番目のコマンドかを示す
+        load_error(st, (unsigned long)n+1);
+        return ERROR;
+    }
+    return COMMAND;
+}
+
+// 符号なしの値を7bitずつ書く
+void put_uvarint(FILE* fp, unsigned long long u){
+    while(u >= 0x80){
+        fputc((int)(u & 0x7f) | 0x80, fp);
+        u >>= 7;
+    }
+    fputc((int)u, fp);
+}
+
+int get_uvarint(const unsigned char** p, const unsigned char* end, unsigned long long* u){
+    unsigned long long v = 0;
+    for(int shift=0 ; shift<64 ; shift+=7){
+        if(*p == end){
+            return 0;
+        }
+        const unsigned char b = *(*p)++;
+        v |= (unsigned long long)(b & 0x7f) << shift;
+        if((b & 0x80) == 0){
+            *u = v;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// キャンバスをRLE形式で保存する
+// スナップショットをタイルごとに読み、空白のタイルは1マスずつ見ずに続きに足す
+int save_canvas_rle(const char* filename, Canvas* c, const int generation){
+    FILE* fp;
+    if((fp = fopen(filename, "wb")) == NULL){
+        report_error("error: cannot open %s.\n", filename);
+        return 0;
+    }
+    unsigned char header[CANVAS_RLE_HEADER_SIZE] = {0};
+    memcpy(header, CANVAS_RLE_MAGIC, 4);
+    header[4] = CANVAS_RLE_VERSION;
+    header[5] = (unsigned char)c->pen;
+    header[6] = (unsigned char)c->colorcode;
+    header[7] = (unsigned char)generation;
+    for(int i=0 ; i<4 ; i++){
+        header[8+i] = (unsigned char)((unsigned int)c->width >> (8*i));
+        header[12+i] = (unsigned char)((unsigned int)c->height >> (8*i));
+    }
+    fwrite(header, 1, sizeof(header), fp);
+
+    Snapshot* s = take_snapshot(c);
+    Cell run = blank_tile.cells[0];
+    unsigned long long len = 0;
+    for(int y=0 ; y<c->height ; y++){
+        for(int x=0 ; x<c->width ; x+=TILE_SIZE){
+            const Tile* t = snapshot_tile(s, x >> TILE_SHIFT, y >> TILE_SHIFT);
+            const int n = (c->width-x < TILE_SIZE) ? c->width-x : TILE_SIZE;
+            const Cell* row = t->cells+((y & TILE_MASK) << TILE_SHIFT);
+            for(int i=0 ; i<n ; i++){
+                if(row[i].ch == run.ch && row[i].color == run.color){
+                    //空白のタイルの残りはすべて同じなのでまとめて足す
+                    if(t == &blank_tile){
+                        len += n-i;
+                        break;
+                    }
+                    len++;
+                    continue;
+                }
+                if(len > 0){
+                    put_uvarint(fp, len);
+                    fputc((unsigned char)run.ch, fp);
+                    fputc(run.color, fp);
+                }
+                run = row[i];
+                len = 1;
+            }
+        }
+    }
+    put_uvarint(fp, len);
+    fputc((unsigned char)run.ch, fp);
+    fputc(run.color, fp);
+    free_snapshot(s);
+
+    //セッションのチェックポイントはこれを置き換えてからログを消すので、ディスクに届くまで待つ
+    const int failed = fflush(fp) != 0 || fsync(fileno(fp)) != 0 || ferror(fp);
+    if(fclose(fp) != 0 || failed){
+        report_error("error: cannot write %s.\n", filename);
+        return 0;
+    }
+    return 1;
+}
+
+// RLE形式のキャンバスを読み込む (全体をresetしてから空白でない部分だけを書く)
+// 大きさが違うファイルや壊れたファイルはメッセージを出して0を返し、キャンバスは変えない
+// headerがNULLでなければファイルのヘッダを写す
+int load_canvas_rle(Canvas* c, const char* filename, unsigned char* header){
+    const int fd = open(filename, O_RDONLY);
+    struct stat sb;
+    if(fd < 0 || fstat(fd, &sb) < 0 || sb.st_size < CANVAS_RLE_HEADER_SIZE){
+        if(fd >= 0){
+            close(fd);
+        }
+        report_error("error: cannot read %s.\n", filename);
+        return 0;
+    }
+    const size_t size = (size_t)sb.st_size;
+    unsigned char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED){
+        report_error("error: cannot read %s.\n", filename);
+        return 0;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    unsigned int width = 0;
+    unsigned int height = 0;
+    for(int i=0 ; i<4 ; i++){
+        width |= (unsigned int)data[8+i] << (8*i);
+        height |= (unsigned int)data[12+i] << (8*i);
+    }
+    const unsigned char* body = data+CANVAS_RLE_HEADER_SIZE;
+    const unsigned long long total = (unsigned long long)c->width*c->height;
+    int ok = 0;
+    if(memcmp(data, CANVAS_RLE_MAGIC, 4) != 0 || data[4] != CANVAS_RLE_VERSION){
+        report_error("error: %s is not a canvas file.\n", filename);
+    }else if(width != (unsigned int)c->width || height != (unsigned int)c->height){
+        report_error("error: %s is %ux%u, not %dx%d.\n", filename, width, height, c->width, c->height);
+    }else if(!valid_pen((char)data[5]) || !valid_color(data[6]) || !decode_canvas_rle(NULL, body, data+size, total)){
+        report_error("error: %s is broken.\n", filename);
+    }else{
+        //書き込む前に全体を確かめてあるので、途中で失敗することはない
+        reset_tiles(c);
+        decode_canvas_rle(c, body, data+size, total);
+        if(header != NULL){
+            memcpy(header, data, CANVAS_RLE_HEADER_SIZE);
+        }
+        ok = 1;
+    }
+    munmap(data, size);
+    return ok;
+}
+
+// 続きを順に読み、空白でない続きを行ごとに分けて書く。cがNULLなら形式を確かめるだけにする
+// 長さの合計がtotalと一致し、余りがなければ1を返す
+int decode_canvas_rle(Canvas* c, const unsigned char* p, const unsigned char* end, const unsigned long long total){
+    unsigned long long pos = 0;
+    while(pos < total){
+        unsigned long long len;
+        if(!get_uvarint(&p, end, &len) || len == 0 || len > total-pos || end-p < 2){
+            return 0;
+        }
+        const char ch = (char)p[0];
+        const unsigned char color = p[1];
+        p += 2;
+        if(!valid_color(color)){
+            return 0;
+        }
+        if(c != NULL && !(ch == ' ' && color == 0)){
+            unsigned long long q = pos;
+            while(q < pos+len){
+                const int y = (int)(q/c->width);
+                const int x = (int)(q%c->width);
+                const unsigned long long rest = pos+len-q;
+                const int n = (rest < (unsigned long long)(c->width-x)) ? (int)rest : c->width-x;
+                put_span(c, y, x, x+n-1, ch, color);
+                q += n;
+            }
+        }
+        pos += len;
+    }
+    return p == end;
+}
+
+// prefix.rleとprefix.logからキャンバスと履歴を作り直し、ログに追記できるようにする
+// チェックポイントに含まれるコマンドは履歴に残らないので、起動し直した後にundoできるのはログの分だけになる
+// 失敗したらメッセージを出してNULLを返す
+Session* open_session(const char* prefix, History* his, Canvas* c){
+    Session* s = (Session*)calloc(1, sizeof(Session));
+    snprintf(s->checkpoint, sizeof(s->checkpoint), "%s.rle", prefix);
+    snprintf(s->log_name, sizeof(s->log_name), "%s.log", prefix);
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    //読み込み中のメッセージは出さず、エラーだけを標準エラー出力に出す
+    const int outer = quiet;
+    quiet = 1;
+    int ok = 1;
+    int restored = 0;
+    struct stat sb;
+    const int checkpoint = (stat(s->checkpoint, &sb) == 0);
+    if(checkpoint){
+        unsigned char header[CANVAS_RLE_HEADER_SIZE];
+        if(load_canvas_rle(c, s->checkpoint, header)){
+            //起動時の読み込みはundoできなくてよいので、resetの記録は捨てる
+            free_reset(c->reset);
+            c->reset = NULL;
+            c->pen = (char)header[5];
+            set_colorcode(c, header[6]);
+            s->generation = header[7];
+            s->checkpoint_size = (long)sb.st_size;
+            restored = 1;
+        }else{
+            fputs(last_message, stderr);
+            ok = 0;
+        }
+    }
+
+    const int fd = ok ? open(s->log_name, O_RDWR | O_CREAT, 0644) : -1;
+    if(ok && (fd < 0 || fstat(fd, &sb) != 0 || (s->log = fdopen(fd, "r+b")) == NULL)){
+        fprintf(stderr, "error: cannot open %s.\n", s->log_name);
+        if(fd >= 0){
+            close(fd);
+        }
+        ok = 0;
+    }
+    //ログのうち読めたところまでの長さ (0ならヘッダから書き直す)
+    size_t valid = 0;
+    unsigned long applied = 0;
+    if(ok && sb.st_size >= SESSION_LOG_HEADER_SIZE){
+        const size_t size = (size_t)sb.st_size;
+        unsigned char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        unsigned int width = 0;
+        unsigned int height = 0;
+        for(int i=0 ; data != MAP_FAILED && i<4 ; i++){
+            width |= (unsigned int)data[8+i] << (8*i);
+            height |= (unsigned int)data[12+i] << (8*i);
+        }
+        if(data == MAP_FAILED){
+            fprintf(stderr, "error: cannot read %s.\n", s->log_name);
+            ok = 0;
+        }else if(memcmp(data, SESSION_LOG_MAGIC, 4) != 0 || data[4] != SESSION_LOG_VERSION){
+            fprintf(stderr, "error: %s is not a session log.\n", s->log_name);
+            ok = 0;
+        }else if(width != (unsigned int)c->width || height != (unsigned int)c->height){
+            fprintf(stderr, "error: %s is %ux%u, not %dx%d.\n", s->log_name, width, height, c->width, c->height);
+            ok = 0;
+        }else if(data[5] != s->generation && !checkpoint){
+            //チェックポイントを作った後のログなのにチェックポイントがない。ログを空にすると元に戻せなくなるので開かない
+            fprintf(stderr, "error: %s is missing; %s needs it.\n", s->checkpoint, s->log_name);
+            ok = 0;
+        }else if(data[5] != s->generation){
+            //チェックポイントを置き換えた後、ログを空にする前に止まったときのログ (中身はチェックポイントに含まれている)
+            fprintf(stderr, "warning: %s does not match %s, ignored.\n", s->log_name, s->checkpoint);
+        }else{
+            madvise(data, size, MADV_SEQUENTIAL);
+            const unsigned char* p = data+SESSION_LOG_HEADER_SIZE;
+            if(!replay_log(&p, data+size, his, c, &applied)){
+                //書き込みの途中で止まったときの最後の記録は捨てる
+                fprintf(stderr, "warning: %s: broken record after %lu commands, the rest is discarded.\n", s->log_name, applied);
+            }
+            valid = (size_t)(p-data);
+            restored = 1;
+        }
+        if(data != MAP_FAILED){
+            munmap(data, size);
+        }
+    }
+    if(ok && valid == 0){
+        ok = write_log_header(s, c);
+        if(!ok){
+            fputs(last_message, stderr);
+        }
+    }else if(ok && valid < (size_t)sb.st_size){
+        if(ftruncate(fd, (off_t)valid) != 0){
+            fprintf(stderr, "error: cannot write %s.\n", s->log_name);
+            ok = 0;
+        }
+    }
+    quiet = outer;
+    if(!ok){
+        if(s->log != NULL){
+            fclose(s->log);
+        }
+        free(s);
+        return NULL;
+    }
+    fseek(s->log, 0, SEEK_END);
+    clock_gettime(CLOCK_MONOTONIC, &s->synced);
+    if(restored){
+        fprintf(stderr, "session %s is restored: %lu commands replayed in %.3f s.\n", prefix, applied, elapsed_since(&t0));
+    }
+    return s;
+}
+
+// 残りのログをディスクに書き、必要ならチェックポイントを作ってから閉じる
+void close_session(History* his, Canvas* c){
+    Session* s = his->session;
+    if(s == NULL){
+        return;
+    }
+    const int ok = s->need_checkpoint ? write_checkpoint(s, his, c) : sync_log(s);
+    if(!ok && quiet){
+        fputs(last_message, stderr);
+    }
+    fclose(s->log);
+    free(s);
+    his->session = NULL;
+}
+
+// ログの記録を順に実行する。*pは最後に読めた記録の次に進め、途中で壊れていたら0を返す
+int replay_log(const unsigned char** p, const unsigned char* end, History* his, Canvas* c, unsigned long* applied){
+    while(*p < end){
+        if(**p == LOG_UNDO){
+            (*p)++;
+            cmd_undo(c, his, NULL, NULL, 0, NULL);
+        }else if(**p == LOG_REDO){
+            (*p)++;
+            cmd_redo(c, his, NULL, NULL, 0, NULL);
+        }else if(**p == LOG_CELLS){
+            //途中で壊れていたら何も書き換えないよう、先に最後まで読めるか確かめる
+            const unsigned char* q = *p+1;
+            if(!get_log_cells(&q, end, c, 0)){
+                return 0;
+            }
+            (*p)++;
+            get_log_cells(p, end, c, 1);
+            //書いたときに今の履歴とredoスタックはログにないものになったので、実行し直した分も捨てる
+            clear_history(his, c);
+        }else{
+            Op op;
+            if(!get_op(p, end, his, &op)){
+                return 0;
+            }
+            record_op(&op, his, c);
+        }
+        (*applied)++;
+    }
+    return 1;
+}
+
+// チェックポイントより前のコマンドをundo/redoした後の、jが書き換えたマスとpen, 色をログに書く
+// 記録は LOG_CELLS, pen, 色, マスの数, (タイルの番号, タイル内の位置, 文字, 色)の並び,
+// タイルの数, (タイルの番号, タイルの中身の同じマスの続き (長さ, 文字, 色) の並び) の並び
+void put_log_cells(FILE* fp, Canvas* c, const Journal* j){
+    fputc(LOG_CELLS, fp);
+    fputc(c->pen, fp);
+    fputc(c->colorcode, fp);
+    put_uvarint(fp, j->len);
+    for(size_t k=0 ; k<j->len ; k++){
+        const Diff* d = &j->diffs[k];
+        const Cell cell = tile_read(c, d->tile%c->tiles_x, d->tile/c->tiles_x)->cells[d->offset];
+        put_uvarint(fp, (unsigned long long)d->tile);
+        put_uvarint(fp, d->offset);
+        fputc(cell.ch, fp);
+        fputc(cell.color, fp);
+    }
+    put_uvarint(fp, j->ntiles);
+    for(size_t k=0 ; k<j->ntiles ; k++){
+        const int tile = j->tiles[k].tile;
+        const Cell* cells = tile_read(c, tile%c->tiles_x, tile/c->tiles_x)->cells;
+        put_uvarint(fp, (unsigned long long)tile);
+        int i = 0;
+        while(i < TILE_SIZE*TILE_SIZE){
+            int n = 1;
+            while(i+n < TILE_SIZE*TILE_SIZE && cells[i+n].ch == cells[i].ch && cells[i+n].color == cells[i].color){
+                n++;
+            }
+            put_uvarint(fp, (unsigned long long)n);
+            fputc(cells[i].ch, fp);
+            fputc(cells[i].color, fp);
+            i += n;
+        }
+    }
+}
+
+// put_log_cellsで書いた記録 (LOG_CELLSの次から) を読む。*pは記録の次に進め、壊れていたら0を返す
+// applyが1ならキャンバスに書き込む (履歴には積まない)
+int get_log_cells(const unsigned char** p, const unsigned char* end, Canvas* c, const int apply){
+    const unsigned long long tiles = (unsigned long long)c->tiles_x*c->tiles_y;
+    if(end-*p < 2 || !valid_pen((char)(*p)[0]) || !valid_color((*p)[1])){
+        return 0;
+    }
+    const char pen = (char)(*p)[0];
+    const unsigned char color = (*p)[1];
+    *p += 2;
+    unsigned long long n;
+    if(!get_uvarint(p, end, &n)){
+        return 0;
+    }
+    for(unsigned long long k=0 ; k<n ; k++){
+        unsigned long long tile;
+        unsigned long long offset;
+        if(!get_uvarint(p, end, &tile) || tile >= tiles || !get_uvarint(p, end, &offset) || offset >= TILE_SIZE*TILE_SIZE
+           || end-*p < 2 || !valid_color((*p)[1])){
+            return 0;
+        }
+        if(apply){
+            Tile* t = tile_write(c, (int)(tile%c->tiles_x), (int)(tile/c->tiles_x));
+            t->cells[offset] = (Cell){.ch = (char)(*p)[0], .color = (*p)[1]};
+        }
+        *p += 2;
+    }
+    if(!get_uvarint(p, end, &n)){
+        return 0;
+    }
+    for(unsigned long long k=0 ; k<n ; k++){
+        unsigned long long tile;
+        if(!get_uvarint(p, end, &tile) || tile >= tiles){
+            return 0;
+        }
+        Tile* t = apply ? tile_write(c, (int)(tile%c->tiles_x), (int)(tile/c->tiles_x)) : NULL;
+        int i = 0;
+        while(i < TILE_SIZE*TILE_SIZE){
+            unsigned long long len;
+            if(!get_uvarint(p, end, &len) || len == 0 || len > (unsigned long long)(TILE_SIZE*TILE_SIZE-i)
+               || end-*p < 2 || !valid_color((*p)[1])){
+                return 0;
+            }
+            for(int m=0 ; apply && m<(int)len ; m++){
+                t->cells[i+m] = (Cell){.ch = (char)(*p)[0], .color = (*p)[1]};
+            }
+            *p += 2;
+            i += (int)len;
+        }
+    }
+    if(apply){
+        c->pen = pen;
+        set_colorcode(c, color);
+        mark_all_dirty(c);
+    }
+    return 1;
+}
+
+// ログを空にしてヘッダだけにする
+int write_log_header(Session* s, Canvas* c){
+    unsigned char header[SESSION_LOG_HEADER_SIZE] = {0};
+    memcpy(header, SESSION_LOG_MAGIC, 4);
+    header[4] = SESSION_LOG_VERSION;
+    header[5] = s->generation;
+    for(int i=0 ; i<4 ; i++){
+        header[8+i] = (unsigned char)((unsigned int)c->width >> (8*i));
+        header[12+i] = (unsigned char)((unsigned int)c->height >> (8*i));
+    }
+    fflush(s->log);
+    if(ftruncate(fileno(s->log), 0) != 0){
+        report_error("error: cannot write %s.\n", s->log_name);
+        return 0;
+    }
+    rewind(s->log);
+    fwrite(header, 1, sizeof(header), s->log);
+    return sync_log(s);
+}
+
+// 今のキャンバスをチェックポイントにしてログを空にする
+// 新しいチェックポイントに置き換わる前に止まっても、古いチェックポイントとログから元に戻せる
+// 置き換えた後、ログを空にする前に止まったときは、ログの世代が合わないので読み飛ばされる
+int write_checkpoint(Session* s, History* his, Canvas* c){
+    char tmp[FILENAME_MAX+8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", s->checkpoint);
+    const unsigned char generation = (unsigned char)(s->generation+1);
+    if(!save_canvas_rle(tmp, c, generation)){
+        return 0;
+    }
+    if(rename(tmp, s->checkpoint) != 0){
+        report_error("error: cannot write %s.\n", s->checkpoint);
+        remove(tmp);
+        return 0;
+    }
+    sync_dir(s->checkpoint);
+    s->generation = generation;
+    struct stat sb;
+    s->checkpoint_size = (stat(s->checkpoint, &sb) == 0) ? (long)sb.st_size : 0;
+    s->base = his->count;
+    s->redo_base = his->redo_count;
+    s->need_checkpoint = 0;
+    return write_log_header(s, c);
+}
+
+int sync_log(Session* s){
+    s->pending = 0;
+    clock_gettime(CLOCK_MONOTONIC, &s->synced);
+    if(fflush(s->log) != 0 || fdatasync(fileno(s->log)) != 0){
+        report_error("error: cannot write %s.\n", s->log_name);
+        return 0;
+    }
+    return 1;
+}
+
+// renameした名前がディスクに届くよう、そのファイルのあるディレクトリをfsyncする
+void sync_dir(const char* path){
+    char dir[FILENAME_MAX];
+    const char* slash = strrchr(path, '/');
+    if(slash == NULL){
+        strcpy(dir, ".");
+    }else{
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash-path+1), path);
+    }
+    const int fd = open(dir, O_RDONLY);
+    if(fd >= 0){
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// 履歴に積んだコマンドをログに追記する
+void session_log_op(History* his, const Op* op){
+    Session* s = his->session;
+    if(s == NULL){
+        return;
+    }
+    //新しいコマンドでredoスタックは空になっている
+    s->redo_base = 0;
+    //loadcanvasは読んだファイルが後で変わるかもしれないので、実行し直さずにチェックポイントに含める
+    if(op->code == OP_LOADCANVAS){
+        s->need_checkpoint = 1;
+    }
+    if(s->need_checkpoint){
+        return;
+    }
+    put_op(s->log, op);
+    s->pending++;
+}
+
+// qをundo/redoしたことをログに追記する
+// チェックポイントより前のコマンドは起動し直すと履歴にないので、それをundo/redoしたら結果のマスを書く
+// その後は今の履歴とredoスタックを全部ログにないものとして数える (ログの後のundo/redoはその上に積んだものだけが対象になる)
+// reset, loadcanvasは全体が変わるので、マスを書く代わりにチェックポイントを作り直す
+void session_log_undo(History* his, Canvas* c, const Command* q, const int code){
+    Session* s = his->session;
+    if(s == NULL || s->need_checkpoint){
+        return;
+    }
+    if((code == LOG_UNDO) ? his->count < s->base : his->redo_count < s->redo_base){
+        if(q->reset != NULL){
+            s->need_checkpoint = 1;
+            return;
+        }
+        put_log_cells(s->log, c, &q->journal);
+        s->base = his->count;
+        s->redo_base = his->redo_count;
+    }else{
+        fputc(code, s->log);
+    }
+    s->pending++;
+}
+
+// mainのループから1コマンドごとに呼ぶ。flushが1なら記録をすぐOSに渡す
+// fsyncはLOG_SYNC_COUNT個ごとかLOG_SYNC_INTERVAL秒ごとにまとめて行い、そのときにログが大きければチェックポイントを作り直す
+void session_commit(History* his, Canvas* c, const int flush){
+    Session* s = his->session;
+    if(s == NULL){
+        return;
+    }
+    int ok = 1;
+    if(s->need_checkpoint){
+        ok = write_checkpoint(s, his, c);
+    }else if(s->pending == 0){
+        return;
+    }else if(s->pending < LOG_SYNC_COUNT && elapsed_since(&s->synced) < LOG_SYNC_INTERVAL){
+        if(flush){
+            fflush(s->log);
+        }
+        return;
+    }else if((ok = sync_log(s))){
+        const long size = ftell(s->log);
+        if(size > LOG_COMPACT_MIN && size > s->checkpoint_size){
+            ok = write_checkpoint(s, his, c);
+        }
+    }
+    //バッチ処理ではreport_errorが何も出さないので、ここで出す
+    if(!ok && quiet){
+        fputs(last_message, stderr);
+    }
+}